@@ -23,6 +23,9 @@
 #include <atomic>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <typeindex>
 #include <typeinfo>
@@ -104,6 +107,57 @@ namespace chainbase {
    #define CHAINBASE_SET_INDEX_TYPE( OBJECT_TYPE, INDEX_TYPE )  \
    namespace chainbase { template<> struct get_index_type<OBJECT_TYPE> { typedef INDEX_TYPE type; }; }
 
+   /**
+    * The version of the layout of an object type, recorded in the database next to its table.
+    * Use the SET_LAYOUT_VERSION macro to increase it whenever the object changes in a way its
+    * size does not reveal, e.g. when a field changes its type or meaning.
+    **/
+   template<typename T>
+   struct get_layout_version { static constexpr uint32_t value = 0; };
+
+   /**
+    *  This macro must be used at global scope and OBJECT_TYPE must be fully qualified
+    */
+   #define CHAINBASE_SET_LAYOUT_VERSION( OBJECT_TYPE, VERSION )  \
+   namespace chainbase { template<> struct get_layout_version<OBJECT_TYPE> { static constexpr uint32_t value = VERSION; }; }
+
+   /**
+    * Describes the layout of a table.  It is stored in the database next to each table, so
+    * that a table written with another layout is detected before it is used, and can be
+    * converted with database::migrate_index.
+    */
+   struct index_layout {
+      uint32_t format      = 1; ///< of index_layout itself
+      uint32_t version     = 0; ///< get_layout_version of the object type
+      uint32_t value_size  = 0;
+      uint32_t node_size   = 0;
+      uint32_t index_size  = 0;
+      uint32_t index_count = 0;
+
+      template<typename IndexType>
+      static index_layout of() {
+         index_layout result;
+         result.version     = get_layout_version<typename IndexType::value_type>::value;
+         result.value_size  = sizeof(typename IndexType::value_type);
+         result.node_size   = sizeof(typename IndexType::node);
+         result.index_size  = sizeof(IndexType);
+         result.index_count = std::tuple_size_v<typename IndexType::indices_type>;
+         return result;
+      }
+
+      friend bool operator == ( const index_layout& a, const index_layout& b ) {
+         return a.format == b.format && a.version == b.version && a.value_size == b.value_size &&
+                a.node_size == b.node_size && a.index_size == b.index_size && a.index_count == b.index_count;
+      }
+      friend bool operator != ( const index_layout& a, const index_layout& b ) { return !( a == b ); }
+
+      std::string to_string()const {
+         return "{version " + std::to_string(version) + ", value size " + std::to_string(value_size) +
+                ", node size " + std::to_string(node_size) + ", table size " + std::to_string(index_size) +
+                ", " + std::to_string(index_count) + " indices}";
+      }
+   };
+
    #define CHAINBASE_DEFAULT_CONSTRUCTOR( OBJECT_TYPE ) \
    template<typename Constructor, typename Allocator> \
    OBJECT_TYPE( Constructor&& c, Allocator&&  ) { c(*this); }
@@ -165,8 +219,15 @@ namespace chainbase {
 
          virtual int64_t revision()const = 0;
          virtual void    undo()const = 0;
+         virtual void    undo_to( int64_t revision )const = 0;
          virtual void    squash()const = 0;
+         virtual void    squash_deferred()const = 0;
+         virtual std::size_t compress_pending( std::size_t max_nodes )const = 0;
+         virtual bool    has_pending_compression()const = 0;
          virtual void    commit( int64_t revision )const = 0;
+         virtual void    commit_deferred( int64_t revision )const = 0;
+         virtual std::size_t reclaim( std::size_t max_nodes )const = 0;
+         virtual bool    has_pending_reclaim()const = 0;
          virtual void    undo_all()const = 0;
          virtual uint32_t type_id()const  = 0;
          virtual uint64_t row_count()const = 0;
@@ -174,10 +235,24 @@ namespace chainbase {
          virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const = 0;
 
          virtual void remove_object( int64_t id ) = 0;
+         virtual void verify()const = 0;
+         virtual uint32_t node_size()const = 0;
 
          void* get()const { return _idx_ptr; }
+
+         // Accesses through the database, see database::index_access_counts
+         void     count_read()const { _reads.fetch_add( 1, std::memory_order_relaxed ); }
+         void     count_write() { _writes.fetch_add( 1, std::memory_order_relaxed ); }
+         uint64_t reads()const { return _reads.load( std::memory_order_relaxed ); }
+         uint64_t writes()const { return _writes.load( std::memory_order_relaxed ); }
+
+         const std::string& segment()const { return _segment; }
+         void set_segment( const std::string& segment ) { _segment = segment; }
       private:
-         void* _idx_ptr;
+         void*                         _idx_ptr;
+         mutable std::atomic<uint64_t> _reads{0};
+         std::atomic<uint64_t>         _writes{0};
+         std::string                   _segment;
    };
 
    template<typename BaseIndex>
@@ -192,8 +267,15 @@ namespace chainbase {
          virtual void     set_revision( uint64_t revision ) override { _base.set_revision( revision ); }
          virtual int64_t  revision()const  override { return _base.revision(); }
          virtual void     undo()const  override { _base.undo(); }
+         virtual void     undo_to( int64_t revision )const  override { _base.undo_to(revision); }
          virtual void     squash()const  override { _base.squash(); }
+         virtual void     squash_deferred()const  override { _base.squash_deferred(); }
+         virtual std::size_t compress_pending( std::size_t max_nodes )const override { return _base.compress_pending(max_nodes); }
+         virtual bool     has_pending_compression()const override { return _base.has_pending_compression(); }
          virtual void     commit( int64_t revision )const  override { _base.commit(revision); }
+         virtual void     commit_deferred( int64_t revision )const  override { _base.commit_deferred(revision); }
+         virtual std::size_t reclaim( std::size_t max_nodes )const override { return _base.reclaim(max_nodes); }
+         virtual bool     has_pending_reclaim()const override { return _base.has_pending_reclaim(); }
          virtual void     undo_all() const override {_base.undo_all(); }
          virtual uint32_t type_id()const override { return BaseIndex::value_type::type_id; }
          virtual uint64_t row_count()const override { return _base.indices().size(); }
@@ -201,6 +283,8 @@ namespace chainbase {
          virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const override { return _base.undo_stack_revision_range(); }
 
          virtual void     remove_object( int64_t id ) override { return _base.remove_object( id ); }
+         virtual void     verify()const override { _base.verify(); }
+         virtual uint32_t node_size()const override { return sizeof( typename BaseIndex::node ); }
       private:
          BaseIndex& _base;
          std::string BaseIndex_name = boost::core::demangle( typeid( typename BaseIndex::value_type ).name() );
@@ -213,6 +297,18 @@ namespace chainbase {
    };
 
 
+   /**
+    * How much an index has been used while access counting was enabled, see
+    * database::index_access_counts.
+    */
+   struct index_access {
+      std::string type_name;
+      std::string segment;     ///< see database::add_segment; empty for the database file
+      uint64_t    reads  = 0;  ///< calls that looked objects up, e.g. find, get, get_index
+      uint64_t    writes = 0;  ///< calls that changed objects, e.g. create, modify, remove
+      uint64_t    size   = 0;  ///< approximate size of the objects in bytes
+   };
+
    class read_write_mutex_manager
    {
       public:
@@ -251,9 +347,16 @@ namespace chainbase {
    class database
    {
       public:
+         /**
+          * An immutable database is opened read only, like read_only, for a file that nothing writes
+          * to any more, e.g. a snapshot served by many query processes.  The file is never copied
+          * into memory of the process: in heap and locked mode it is read into the page cache that
+          * the processes share instead, see pinnable_mapped_file.
+          */
          enum open_flags {
             read_only     = 0,
-            read_write    = 1
+            read_write    = 1,
+            immutable     = 2
          };
 
          using database_index_row_count_multiset = std::multiset<std::pair<unsigned, std::string>>;
@@ -266,6 +369,18 @@ namespace chainbase {
          database& operator=(database&&) = default;
          bool is_read_only() const { return _read_only; }
          void flush();
+
+         /**
+          * In lazy map mode, blocks until the database file and its segments have been loaded
+          * into memory, and throws if one of them does not match its checksums.
+          */
+         void wait_for_load();
+
+         /**
+          * The pages that the database file is loaded into, e.g. to tell whether it got huge
+          * pages; see pinnable_mapped_file::memory_backing.
+          */
+         const std::vector<pinnable_mapped_file::backing_region>& memory_backing()const { return _db_file.memory_backing(); }
          void set_require_locking( bool enable_require_locking );
 
 #ifdef CHAINBASE_CHECK_LOCKING
@@ -286,8 +401,9 @@ namespace chainbase {
 
          struct session {
             public:
-               session( session&& s ):_index_sessions( std::move(s._index_sessions) ){}
-               session( vector<std::unique_ptr<abstract_session>>&& s ):_index_sessions( std::move(s) )
+               session( session&& s ):_index_sessions( std::move(s._index_sessions) ),_speculation( std::move(s._speculation) ){}
+               session( vector<std::unique_ptr<abstract_session>>&& s, std::shared_ptr<void> speculation = {} )
+                  :_index_sessions( std::move(s) ),_speculation( std::move(speculation) )
                {
                }
 
@@ -299,18 +415,21 @@ namespace chainbase {
                {
                   for( auto& i : _index_sessions ) i->push();
                   _index_sessions.clear();
+                  _speculation.reset();
                }
 
                void squash()
                {
                   for( auto& i : _index_sessions ) i->squash();
                   _index_sessions.clear();
+                  _speculation.reset();
                }
 
                void undo()
                {
                   for( auto& i : _index_sessions ) i->undo();
                   _index_sessions.clear();
+                  _speculation.reset();
                }
 
             private:
@@ -318,6 +437,7 @@ namespace chainbase {
                session(){}
 
                vector< std::unique_ptr<abstract_session> > _index_sessions;
+               std::shared_ptr<void>                        _speculation; // see database::_speculation
          };
 
          session start_undo_session( bool enabled );
@@ -328,8 +448,63 @@ namespace chainbase {
          }
 
          void undo();
+
+         /**
+          * Undoes every session after revision at once, restoring each changed object once
+          * rather than once per session (see undo_index::undo_to).
+          */
+         void undo_to( int64_t revision );
+
+         /**
+          * Copy-on-write speculation, for work that is usually thrown away.  While speculating,
+          * the database file is mapped privately, so the first write to each page makes a copy
+          * of it that only this process sees, and everything else reads through to the file.
+          * Nothing is saved for undo, so changes cost no more than outside of an undo session.
+          *
+          * discard_speculation drops the copies, which returns every index to its state from
+          * before start_speculation, undo stacks included; indices added since are removed.
+          * commit_speculation writes the copied pages back to the file.  Both take time in
+          * proportion to the pages written, not the objects changed.  Undo sessions started
+          * while speculating must be pushed, squashed or undone before the speculation is
+          * discarded, since their undo states are discarded with it; discard_speculation
+          * throws std::logic_error while one is open.  If writing back fails, the speculation
+          * can only be committed again, and the file is left dirty until that succeeds.
+          *
+          * Only available on a writable database in mapped mode, with every segment (see
+          * add_segment) in mapped mode as well.  Destroying the database
+          * while speculating discards the speculation.
+          */
+         void start_speculation();
+         void commit_speculation();
+         void discard_speculation();
+         bool is_speculating()const { return _db_file.is_speculating(); }
          void squash();
+
+         /**
+          * Like squash, but takes constant time.  The undo history that becomes redundant is
+          * removed by later calls to compress_pending, e.g. when the caller is idle.
+          */
+         void squash_deferred();
+
+         /**
+          * Removes redundant undo history left by squash_deferred, examining up to max_nodes
+          * objects across all indices.  Returns true if more remains to be examined.
+          */
+         bool compress_pending( std::size_t max_nodes );
          void commit( int64_t revision );
+
+         /**
+          * Like commit, but the discarded undo history is only detached, which takes constant
+          * time.  It is freed by later calls to reclaim (or by the next commit), so that
+          * committing a large backlog does not stall the caller.
+          */
+         void commit_deferred( int64_t revision );
+
+         /**
+          * Frees up to max_nodes objects of the undo history discarded by commit_deferred,
+          * across all indices.  Returns true if more remain to be freed.
+          */
+         bool reclaim( std::size_t max_nodes );
          void undo_all();
 
 
@@ -340,72 +515,150 @@ namespace chainbase {
          }
 
 
+         /**
+          * Opens a secondary segment of the database, creating it if needed, for indices that
+          * should not share the database file: e.g. a large table can be left in mapped mode
+          * while the small, hot ones are locked in memory.  The segment is a file of its own,
+          * named after the segment, next to the database file, with its own size, map mode and
+          * hugepage paths (see the database constructor).  Indices are placed in it by
+          * add_index( name ).  Undo sessions, commits and speculation cover the indices of all
+          * segments alike.
+          *
+          * Segments are not recorded in the database file, so they must be opened again, with
+          * the same names, each time the database is opened, before their indices are added.
+          */
+         void add_segment( const std::string& name, uint64_t size,
+                           pinnable_mapped_file::map_mode mode = pinnable_mapped_file::map_mode::mapped,
+                           std::vector<std::string> hugepage_paths = std::vector<std::string>() );
+
+         /**
+          * Adds the index for MultiIndexType, whose table is stored in the segment chosen for it
+          * by set_index_placement, or else in the database file.
+          */
          template<typename MultiIndexType>
          void add_index() {
-            const uint16_t type_id = generic_index<MultiIndexType>::value_type::type_id;
-            typedef generic_index<MultiIndexType>          index_type;
-            typedef typename index_type::allocator_type    index_alloc;
-
-            std::string type_name = boost::core::demangle( typeid( typename index_type::value_type ).name() );
-
-            if( !( _index_map.size() <= type_id || _index_map[ type_id ] == nullptr ) ) {
-               BOOST_THROW_EXCEPTION( std::logic_error( type_name + "::type_id is already in use" ) );
-            }
+            const std::string segment_name = placed_segment< generic_index<MultiIndexType> >();
+            add_index_to_segment< MultiIndexType >( segment_manager_of( segment_name ), segment_name );
+         }
 
-            index_type* idx_ptr = nullptr;
-            if( _read_only )
-               idx_ptr = _db_file.get_segment_manager()->find_no_lock< index_type >( type_name.c_str() ).first;
-            else
-               idx_ptr = _db_file.get_segment_manager()->find< index_type >( type_name.c_str() ).first;
-            bool first_time_adding = false;
-            if( !idx_ptr ) {
-               if( _read_only ) {
-                  BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find index for " + type_name + " in read only database" ) );
-               }
-               first_time_adding = true;
-               idx_ptr = _db_file.get_segment_manager()->construct< index_type >( type_name.c_str() )( index_alloc( _db_file.get_segment_manager() ) );
-             }
+         /**
+          * Like add_index(), but the table is stored in the segment opened by add_segment( segment_name ).
+          */
+         template<typename MultiIndexType>
+         void add_index( const std::string& segment_name ) {
+            add_index_to_segment< MultiIndexType >( get_segment_manager( segment_name ), segment_name );
+         }
 
-            idx_ptr->validate();
+         /**
+          * Chooses the segment of each table that add_index<MultiIndexType>() adds from then on, by
+          * the demangled name of its object type; an empty segment name is the database file.
+          * The segments named must be added with add_segment before the indices.  A table stays
+          * in the segment it was created in: placing a stored table elsewhere makes add_index
+          * throw, so a new placement takes effect when the tables are created, e.g. when the
+          * database is built again from a snapshot.
+          */
+         void set_index_placement( std::map<std::string, std::string> placement ) { _index_placement = std::move( placement ); }
+         const std::map<std::string, std::string>& index_placement()const { return _index_placement; }
 
-            // Ensure the undo stack of added index is consistent with the other indices in the database
-            if( _index_list.size() > 0 ) {
-               auto expected_revision_range = _index_list.front()->undo_stack_revision_range();
-               auto added_index_revision_range = idx_ptr->undo_stack_revision_range();
+         /**
+          * Returns how much each index has been used while access counting was enabled.  Every
+          * call that reaches the index through the database, e.g. find, get, create or modify,
+          * counts as one access.
+          */
+         std::vector<index_access> index_access_counts()const;
 
-               if( added_index_revision_range.first != expected_revision_range.first ||
-                   added_index_revision_range.second != expected_revision_range.second ) {
+         /**
+          * Turns the counting for index_access_counts on or off.  It is off by default, because
+          * every access then updates a counter that all threads share.  Like set_index_placement,
+          * this must not be called while other threads use the database.
+          */
+         void set_access_counting( bool enabled ) { _count_accesses = enabled; }
+         bool access_counting()const { return _count_accesses; }
 
-                  if( !first_time_adding ) {
-                     BOOST_THROW_EXCEPTION( std::logic_error(
-                        "existing index for " + type_name + " has an undo stack (revision range [" +
-                        std::to_string(added_index_revision_range.first) + ", " + std::to_string(added_index_revision_range.second) +
-                        "]) that is inconsistent with other indices in the database (revision range [" +
-                        std::to_string(expected_revision_range.first) + ", " + std::to_string(expected_revision_range.second) +
-                        "]); corrupted database?"
-                     ) );
-                  }
+         /**
+          * A placement for set_index_placement that keeps the indices with the most accesses per
+          * byte, up to hot_bytes in all, in hot_segment, e.g. the database file in heap or
+          * locked mode, and the others in cold_segment, e.g. a segment in mapped mode.
+          */
+         static std::map<std::string, std::string> tiered_index_placement( const std::vector<index_access>& accesses, uint64_t hot_bytes,
+                                                                           const std::string& hot_segment, const std::string& cold_segment );
 
-                  if( _read_only ) {
-                     BOOST_THROW_EXCEPTION( std::logic_error(
-                        "new index for " + type_name +
-                        " requires an undo stack that is consistent with other indices in the database; cannot fix in read-only mode"
-                     ) );
-                  }
+         /**
+          * Adds the index for MultiIndexType when the database stores the same object type
+          * with the indices of PreviousMultiIndexType, e.g. because the schema gained an index.
+          * The stored objects are copied into a table with the new indices, which are built
+          * in bulk (see undo_index::copy_from), and then the index is added as by add_index.
+          * If the stored table already has the new layout, or there is none, this is just
+          * add_index<MultiIndexType>().
+          *
+          * The stored table must not have an undo stack.  Its layout is read from the layout
+          * stored next to it (see index_layout), or, for tables written before layouts were
+          * recorded, told apart by the size of the table.  It is looked for in the segment
+          * that add_index<MultiIndexType>() would store it in (see set_index_placement).
+          */
+         template<typename MultiIndexType, typename PreviousMultiIndexType>
+         void upgrade_index() {
+            upgrade_index< MultiIndexType, PreviousMultiIndexType >( placed_segment< generic_index<MultiIndexType> >() );
+         }
 
-                  idx_ptr->set_revision( static_cast<uint64_t>(expected_revision_range.first) );
-                  while( idx_ptr->revision() < expected_revision_range.second ) {
-                     idx_ptr->start_undo_session(true).push();
-                  }
-               }
-            }
+         /**
+          * Like upgrade_index(), but the table is stored in the segment opened by
+          * add_segment( segment_name ), or in the database file if segment_name is empty.
+          */
+         template<typename MultiIndexType, typename PreviousMultiIndexType>
+         void upgrade_index( const std::string& segment_name ) {
+            typedef generic_index<MultiIndexType>          index_type;
+            typedef generic_index<PreviousMultiIndexType>  previous_index_type;
+            static_assert( std::is_same_v<typename index_type::value_type, typename previous_index_type::value_type>,
+                           "upgrade_index requires indices of the same object type" );
+
+            auto* segment = segment_manager_of( segment_name );
+            replace_stored_index< index_type, previous_index_type >( segment, []( index_type& built, const previous_index_type& previous ) {
+               built.copy_from( previous );
+            } );
+            add_index_to_segment< MultiIndexType >( segment, segment_name );
+         }
 
-            if( type_id >= _index_map.size() )
-               _index_map.resize( type_id + 1 );
+         /**
+          * Adds the index for MultiIndexType when the database stores the table of its object
+          * type in the layout of PreviousMultiIndexType, whose object type is the previous
+          * version of the object (declared under another name for this purpose).  Every stored
+          * object is converted by calling convert( const previous_object&, object& ), with
+          * the id of the new object already set, and the indices are then built in bulk.
+          * Conversions run on several threads; see undo_index::convert_from.  If the stored
+          * table already has the new layout, or there is none, this is just
+          * add_index<MultiIndexType>().
+          *
+          * The stored table must not have an undo stack.  Its layout is read from the layout
+          * stored next to it (see index_layout).  A table written before layouts were recorded
+          * is taken to have the previous layout if its size matches it.  As with upgrade_index,
+          * the table is looked for in the segment that add_index<MultiIndexType>() would store
+          * it in.
+          *
+          * A migration that is interrupted is completed by the next call.
+          */
+         template<typename MultiIndexType, typename PreviousMultiIndexType, typename Converter>
+         void migrate_index( Converter&& convert ) {
+            migrate_index< MultiIndexType, PreviousMultiIndexType >( placed_segment< generic_index<MultiIndexType> >(),
+                                                                     std::forward< Converter >( convert ) );
+         }
 
-            auto new_index = new index<index_type>( *idx_ptr );
-            _index_map[ type_id ].reset( new_index );
-            _index_list.push_back( new_index );
+         /**
+          * Like migrate_index( convert ), but the table is stored in the segment opened by
+          * add_segment( segment_name ), or in the database file if segment_name is empty.
+          */
+         template<typename MultiIndexType, typename PreviousMultiIndexType, typename Converter>
+         void migrate_index( const std::string& segment_name, Converter&& convert ) {
+            typedef generic_index<MultiIndexType>          index_type;
+            typedef generic_index<PreviousMultiIndexType>  previous_index_type;
+            static_assert( index_type::value_type::type_id == previous_index_type::value_type::type_id,
+                           "migrate_index requires object types with the same type_id" );
+
+            auto* segment = segment_manager_of( segment_name );
+            replace_stored_index< index_type, previous_index_type >( segment, [&]( index_type& built, const previous_index_type& previous ) {
+               built.convert_from( previous, convert );
+            } );
+            add_index_to_segment< MultiIndexType >( segment, segment_name );
          }
 
          auto get_segment_manager() -> decltype( ((pinnable_mapped_file*)nullptr)->get_segment_manager()) {
@@ -416,6 +669,14 @@ namespace chainbase {
             return _db_file.get_segment_manager();
          }
 
+         pinnable_mapped_file::segment_manager* get_segment_manager( const std::string& segment_name )const {
+            auto itr = _segments.find( segment_name );
+            if( itr == _segments.end() ) {
+               BOOST_THROW_EXCEPTION( std::logic_error( "segment " + segment_name + " has not been added" ) );
+            }
+            return itr->second.get_segment_manager();
+         }
+
          size_t get_free_memory()const
          {
             return _db_file.get_segment_manager()->get_free_memory();
@@ -429,6 +690,7 @@ namespace chainbase {
             typedef index_type*                   index_type_ptr;
             assert( _index_map.size() > index_type::value_type::type_id );
             assert( _index_map[index_type::value_type::type_id] );
+            if( _count_accesses ) _index_map[index_type::value_type::type_id]->count_read();
             return *index_type_ptr( _index_map[index_type::value_type::type_id]->get() );
          }
 
@@ -440,6 +702,7 @@ namespace chainbase {
             typedef index_type*                   index_type_ptr;
             assert( _index_map.size() > index_type::value_type::type_id );
             assert( _index_map[index_type::value_type::type_id] );
+            if( _count_accesses ) _index_map[index_type::value_type::type_id]->count_read();
             return index_type_ptr( _index_map[index_type::value_type::type_id]->get() )->indices().template get<ByIndex>();
          }
 
@@ -451,6 +714,7 @@ namespace chainbase {
             typedef index_type*                   index_type_ptr;
             assert( _index_map.size() > index_type::value_type::type_id );
             assert( _index_map[index_type::value_type::type_id] );
+            if( _count_accesses ) _index_map[index_type::value_type::type_id]->count_write();
             return *index_type_ptr( _index_map[index_type::value_type::type_id]->get() );
          }
 
@@ -459,6 +723,8 @@ namespace chainbase {
          {
              CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
              typedef typename get_index_type< ObjectType >::type index_type;
+             if( !_read_only ) // the lookup cache is filled by lookups, which needs a writable segment
+                return get_index< index_type >().template find< IndexedByType >( std::forward< CompatibleKey >( key ) );
              const auto& idx = get_index< index_type >().indices().template get< IndexedByType >();
              auto itr = idx.find( std::forward< CompatibleKey >( key ) );
              if( itr == idx.end() ) return nullptr;
@@ -473,6 +739,56 @@ namespace chainbase {
              return get_index< index_type >().find( key );
          }
 
+         /**
+          * Turns the id table of the table of ObjectType on or off (see undo_index::set_id_table),
+          * which makes finding an object by id a single array access instead of a tree walk.
+          * The setting is stored with the table, so it lasts when the database is opened again,
+          * and is kept by upgrade_index and migrate_index.
+          */
+         template< typename ObjectType >
+         void set_id_table( bool enabled )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("set_id_table", ObjectType);
+             typedef typename get_index_type< ObjectType >::type index_type;
+             get_mutable_index< index_type >().set_id_table( enabled );
+         }
+
+         /**
+          * Sets the number of entries of the lookup cache of the table of ObjectType (see
+          * undo_index::set_lookup_cache_size), which answers repeated calls to find and get by
+          * the key of an index without walking the tree.  0 turns the cache off.  The cache is
+          * only used while the database is writable, because lookups fill it.
+          */
+         template< typename ObjectType >
+         void set_lookup_cache_size( std::size_t entries )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("set_lookup_cache_size", ObjectType);
+             typedef typename get_index_type< ObjectType >::type index_type;
+             get_mutable_index< index_type >().set_lookup_cache_size( entries );
+         }
+
+         /**
+          * Looks up every key in [first, last) and writes a const ObjectType* (nullptr if
+          * not found) to out for each one, in input order.  The tree walks of several keys
+          * are interleaved, which is considerably faster than calling find() in a loop.
+          * KeyIter must be a forward iterator, because each key is read more than once.
+          */
+         template< typename ObjectType, typename IndexedByType, typename KeyIter, typename OutIter >
+         OutIter find_many( KeyIter first, KeyIter last, OutIter out )const
+         {
+             CHAINBASE_REQUIRE_READ_LOCK("find_many", ObjectType);
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return get_index< index_type >().indices().template get< IndexedByType >().find_many( first, last, out );
+         }
+
+         template< typename ObjectType, typename KeyIter, typename OutIter >
+         OutIter find_many( KeyIter first, KeyIter last, OutIter out )const
+         {
+             CHAINBASE_REQUIRE_READ_LOCK("find_many", ObjectType);
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return get_index< index_type >().find_many( first, last, out );
+         }
+
          template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
          const ObjectType& get( CompatibleKey&& key )const
          {
@@ -515,6 +831,35 @@ namespace chainbase {
              return get_mutable_index<index_type>().remove( obj );
          }
 
+         /**
+          * Removes every object whose key in the index identified by IndexTag is in [lo, hi),
+          * e.g. all the rows of one table, and returns the number removed.  This is undone
+          * like the equivalent calls to remove, but does not erase the objects from the
+          * index IndexTag one at a time (see undo_index::erase_range).
+          */
+         template<typename ObjectType, typename IndexTag, typename LowKey, typename HighKey>
+         std::size_t erase_range( const LowKey& lo, const HighKey& hi )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("erase_range", ObjectType);
+             typedef typename get_index_type<ObjectType>::type index_type;
+             return get_mutable_index<index_type>().template erase_range<IndexTag>( lo, hi );
+         }
+
+         /**
+          * Creates count objects, calling con( object, i ) to construct the i-th one, whose keys
+          * in the index identified by IndexTag must be increasing and must not overlap the keys
+          * of the objects already there, e.g. all the rows of a new table.  This is undone like
+          * the equivalent calls to create, but does not insert the objects into the index
+          * IndexTag one at a time (see undo_index::insert_sorted_run).
+          */
+         template<typename ObjectType, typename IndexTag, typename Constructor>
+         void insert_sorted_run( std::size_t count, Constructor&& con )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("insert_sorted_run", ObjectType);
+             typedef typename get_index_type<ObjectType>::type index_type;
+             get_mutable_index<index_type>().template insert_sorted_run<IndexTag>( count, std::forward<Constructor>(con) );
+         }
+
          template<typename ObjectType, typename Constructor>
          const ObjectType& create( Constructor&& con )
          {
@@ -523,6 +868,14 @@ namespace chainbase {
              return get_mutable_index<index_type>().emplace( std::forward<Constructor>(con) );
          }
 
+         /**
+          * Checks the invariants of every index that has been added (see undo_index::verify),
+          * e.g. to decide whether a database that was left dirty can still be used.  Each
+          * index is checked on its own thread.  Returns one description per problem found,
+          * prefixed with the name of the object type; empty if no problem was found.
+          */
+         std::vector<std::string> check_integrity()const;
+
          database_index_row_count_multiset row_count_per_index()const {
             database_index_row_count_multiset ret;
             for(const auto& ai_ptr : _index_map) {
@@ -534,8 +887,207 @@ namespace chainbase {
          }
 
       private:
+         /**
+          * Adds the index for MultiIndexType stored in segment, the segment manager of the
+          * database file (segment_name empty) or of the secondary segment segment_name.
+          */
+         template<typename MultiIndexType>
+         void add_index_to_segment( pinnable_mapped_file::segment_manager* segment, const std::string& segment_name ) {
+            const uint16_t type_id = generic_index<MultiIndexType>::value_type::type_id;
+            typedef generic_index<MultiIndexType>          index_type;
+            typedef typename index_type::allocator_type    index_alloc;
+
+            std::string type_name = boost::core::demangle( typeid( typename index_type::value_type ).name() );
+
+            if( !( _index_map.size() <= type_id || _index_map[ type_id ] == nullptr ) ) {
+               BOOST_THROW_EXCEPTION( std::logic_error( type_name + "::type_id is already in use" ) );
+            }
+
+            if( auto stored_in = find_in_other_segment( segment, type_name ) ) {
+               BOOST_THROW_EXCEPTION( std::logic_error( "index for " + type_name + " is stored in " + *stored_in +
+                                                        ( segment_name.empty() ? ", not in the database file" : ", not in segment " + segment_name ) ) );
+            }
+
+            const index_layout expected_layout = index_layout::of< index_type >();
+            if( const index_layout* stored_layout = find_layout( segment, type_name ) ) {
+               if( *stored_layout != expected_layout ) {
+                  BOOST_THROW_EXCEPTION( std::runtime_error( "layout of the stored index for " + type_name + " " + stored_layout->to_string() +
+                                                             " does not match the layout expected by executable " + expected_layout.to_string() ) );
+               }
+            }
+
+            index_type* idx_ptr = nullptr;
+            if( _read_only )
+               idx_ptr = segment->find_no_lock< index_type >( type_name.c_str() ).first;
+            else
+               idx_ptr = segment->find< index_type >( type_name.c_str() ).first;
+            bool first_time_adding = false;
+            if( !idx_ptr ) {
+               if( _read_only ) {
+                  BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find index for " + type_name + " in read only database" ) );
+               }
+               first_time_adding = true;
+               idx_ptr = segment->construct< index_type >( type_name.c_str() )( index_alloc( segment ) );
+             }
+
+            idx_ptr->validate();
+
+            // Tables written before layouts were recorded get their layout recorded here.
+            if( !_read_only )
+               segment->find_or_construct< index_layout >( layout_name( type_name ).c_str() )( expected_layout );
+
+            // Ensure the undo stack of added index is consistent with the other indices in the database
+            if( _index_list.size() > 0 ) {
+               auto expected_revision_range = _index_list.front()->undo_stack_revision_range();
+               auto added_index_revision_range = idx_ptr->undo_stack_revision_range();
+
+               if( added_index_revision_range.first != expected_revision_range.first ||
+                   added_index_revision_range.second != expected_revision_range.second ) {
+
+                  if( !first_time_adding ) {
+                     BOOST_THROW_EXCEPTION( std::logic_error(
+                        "existing index for " + type_name + " has an undo stack (revision range [" +
+                        std::to_string(added_index_revision_range.first) + ", " + std::to_string(added_index_revision_range.second) +
+                        "]) that is inconsistent with other indices in the database (revision range [" +
+                        std::to_string(expected_revision_range.first) + ", " + std::to_string(expected_revision_range.second) +
+                        "]); corrupted database?"
+                     ) );
+                  }
+
+                  if( _read_only ) {
+                     BOOST_THROW_EXCEPTION( std::logic_error(
+                        "new index for " + type_name +
+                        " requires an undo stack that is consistent with other indices in the database; cannot fix in read-only mode"
+                     ) );
+                  }
+
+                  idx_ptr->set_revision( static_cast<uint64_t>(expected_revision_range.first) );
+                  while( idx_ptr->revision() < expected_revision_range.second ) {
+                     idx_ptr->start_undo_session(true).push();
+                  }
+               }
+            }
+
+            if( type_id >= _index_map.size() )
+               _index_map.resize( type_id + 1 );
+
+            auto new_index = new index<index_type>( *idx_ptr );
+            new_index->set_segment( segment_name );
+            _index_map[ type_id ].reset( new_index );
+            _index_list.push_back( new_index );
+         }
+
+         static std::string layout_name( const std::string& type_name ) { return type_name + "@layout"; }
+
+         /**
+          * The name of the segment that add_index() stores the table of IndexType in, see
+          * set_index_placement; empty for the database file
+          */
+         template<typename IndexType>
+         std::string placed_segment()const {
+            auto placement = _index_placement.find( boost::core::demangle( typeid( typename IndexType::value_type ).name() ) );
+            return placement == _index_placement.end() ? std::string() : placement->second;
+         }
+
+         pinnable_mapped_file::segment_manager* segment_manager_of( const std::string& segment_name )const {
+            return segment_name.empty() ? _db_file.get_segment_manager() : get_segment_manager( segment_name );
+         }
+
+         /**
+          * Returns a description of the segment, other than segment, that stores a table under
+          * type_name, if there is one
+          */
+         std::optional<std::string> find_in_other_segment( pinnable_mapped_file::segment_manager* segment, const std::string& type_name )const;
+
+         const index_layout* find_layout( pinnable_mapped_file::segment_manager* segment, const std::string& type_name )const {
+            if( _read_only )
+               return segment->find_no_lock< index_layout >( layout_name( type_name ).c_str() ).first;
+            return segment->find< index_layout >( layout_name( type_name ).c_str() ).first;
+         }
+
+         /**
+          * Returns whether the table stored in segment under type_name has the layout of
+          * IndexType.  Tables without a stored layout are recognized by their size alone.
+          */
+         template<typename IndexType>
+         bool has_stored_layout( pinnable_mapped_file::segment_manager* segment, const std::string& type_name )const {
+            if( const index_layout* stored_layout = find_layout( segment, type_name ) )
+               return *stored_layout == index_layout::of< IndexType >();
+            auto stored = segment->find< char >( type_name.c_str() );
+            return stored.first && stored.second == sizeof(IndexType) &&
+                   reinterpret_cast< const IndexType* >( stored.first )->has_expected_layout();
+         }
+
+         /**
+          * If the table of the object type of IndexType is stored in segment with the layout of
+          * PreviousIndexType, replaces it with a table of IndexType filled by
+          * build( IndexType&, PreviousIndexType& ).
+          *
+          * The new table is built under a temporary name, because the stored table keeps
+          * its name until the new one is complete.  build must not change the stored table,
+          * so that if the process stops before the stored table is destroyed, the next call
+          * builds the new table again from a complete one.  If the process stops after the
+          * stored table is destroyed, the next call moves the new table into place.
+          */
+         template<typename IndexType, typename PreviousIndexType, typename Builder>
+         void replace_stored_index( pinnable_mapped_file::segment_manager* segment, Builder&& build ) {
+            static_assert( std::is_invocable_v<Builder, IndexType&, const PreviousIndexType&>,
+                           "the stored table must be left complete until it is replaced" );
+            typedef typename IndexType::allocator_type index_alloc;
+            if( _read_only ) return;
+
+            std::string type_name = boost::core::demangle( typeid( typename IndexType::value_type ).name() );
+            std::string temp_name = type_name + "@upgrade";
+
+            if( has_stored_layout< PreviousIndexType >( segment, type_name ) ) {
+               PreviousIndexType* previous_ptr = segment->find< PreviousIndexType >( type_name.c_str() ).first;
+               previous_ptr->validate();
+               segment->destroy< IndexType >( temp_name.c_str() );
+               IndexType* built_ptr = segment->construct< IndexType >( temp_name.c_str() )( index_alloc( segment ) );
+               auto guard = scope_exit{[&]{ segment->destroy< IndexType >( temp_name.c_str() ); }};
+               build( *built_ptr, *previous_ptr );
+               guard.cancel();
+               segment->destroy< index_layout >( layout_name( type_name ).c_str() );
+               segment->destroy< PreviousIndexType >( type_name.c_str() );
+            }
+            if( !segment->find< char >( type_name.c_str() ).first ) {
+               if( IndexType* built_ptr = segment->find< IndexType >( temp_name.c_str() ).first ) {
+                  segment->construct< IndexType >( type_name.c_str() )( std::move( *built_ptr ) );
+                  segment->destroy< IndexType >( temp_name.c_str() );
+               }
+            }
+         }
+
          pinnable_mapped_file                                        _db_file;
          bool                                                        _read_only = false;
+         bool                                                        _immutable = false;
+         bfs::path                                                   _dir;
+         bool                                                        _allow_dirty = false;
+
+         /**
+          * The secondary segments by name, see add_segment
+          */
+         std::map<std::string, pinnable_mapped_file>                 _segments;
+
+         /**
+          * The segment of each table by type name, see set_index_placement
+          */
+         std::map<std::string, std::string>                          _index_placement;
+
+         /**
+          * Whether accesses are counted, see set_access_counting
+          */
+         bool                                                        _count_accesses = false;
+
+         /**
+          * The number of indices when the speculation started
+          */
+         size_t                                                      _speculation_index_count = 0;
+
+         /**
+          * Shared with the undo sessions started while speculating, until they are closed
+          */
+         std::shared_ptr<void>                                       _speculation;
 
          /**
           * This is a sparse list of known indices kept to accelerate creation of undo sessions
@@ -557,3 +1109,10 @@ namespace chainbase {
    template<typename Object, typename... Args>
    using shared_multi_index_container = boost::multi_index_container<Object,Args..., chainbase::node_allocator<Object> >;
 }  // namepsace chainbase
+
+namespace std {
+   template<typename T>
+   struct hash<chainbase::oid<T>> {
+      size_t operator()( const chainbase::oid<T>& id )const { return std::hash<int64_t>{}( id._id ); }
+   };
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <utility>
 #include <boost/interprocess/offset_ptr.hpp>
 
 #include <chainbase/pinnable_mapped_file.hpp>
@@ -17,6 +18,8 @@ namespace chainbase {
       using segment_manager = pinnable_mapped_file::segment_manager;
       chainbase_node_allocator(segment_manager* manager) : _manager{manager} {}
       chainbase_node_allocator(const chainbase_node_allocator& other) : _manager(other._manager) {}
+      // Takes over the free nodes of other, which would otherwise be lost to the segment.
+      chainbase_node_allocator(chainbase_node_allocator&& other) : _manager(other._manager), _freelist(std::exchange(other._freelist, nullptr)) {}
       template<typename U>
       chainbase_node_allocator(const chainbase_node_allocator<U, S>& other) : _manager(other._manager) {}
       pointer allocate(std::size_t num) {
@@ -42,6 +45,13 @@ namespace chainbase {
       bool operator==(const chainbase_node_allocator& other) const { return this == &other; }
       bool operator!=(const chainbase_node_allocator& other) const { return this != &other; }
       segment_manager* get_segment_manager() const { return _manager.get(); }
+      // Calls f(p) for every node on the free list, until f returns false.
+      template<typename F>
+      void for_each_free(F&& f) const {
+         for(auto p = _freelist; p != nullptr; p = p->_next) {
+            if(!f(static_cast<const void*>(&*p))) return;
+         }
+      }
     private:
       template<typename T2, typename S2>
       friend class chainbase_node_allocator;
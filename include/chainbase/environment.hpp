@@ -1,5 +1,8 @@
 #pragma once
 #include <chainbase/pinnable_mapped_file.hpp>
+#include <array>
+#include <cstddef>
+#include <cstring>
 #include <iomanip>
 
 namespace chainbase {
@@ -7,6 +10,72 @@ namespace chainbase {
 constexpr size_t header_size = 1024;
 constexpr uint64_t header_id = 0x3242444f49534f45ULL; //"EOSIODB2" little endian
 
+/**
+ * Everything the representation of the segment in the database file depends on, besides the
+ * layouts of the tables themselves (see index_layout).  Every field has a fixed size, so this
+ * can be compared between executables built by different compilers or with different boost
+ * versions.  Since it cannot describe everything boost keeps in the segment, the boost version
+ * is checked as well (see same_segment_boost_versions).
+ *
+ * Environments written before the segment layout was recorded hold zeros in its place.
+ */
+struct segment_layout {
+   /// Increase when a boost version changes the representation of the segment manager in a
+   /// way that the sizes below do not reveal.
+   static constexpr uint32_t current_format = 1;
+
+   struct zero_t {};
+
+   segment_layout() = default;
+   /// Every field zero, as held by environments written before the layout was recorded
+   explicit segment_layout(zero_t)
+      : format(0), little_endian(0), pointer_size(0), long_size(0), max_align(0), offset_ptr_size(0),
+        segment_manager_size(0), memory_algorithm_size(0), allocation_alignment(0), allocation_overhead(0) {}
+
+   uint32_t format = current_format;
+   uint8_t  little_endian =
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      0;
+#else
+      1;
+#endif
+   uint8_t  pointer_size = sizeof(void*);
+   uint8_t  long_size = sizeof(long);
+   uint8_t  max_align = alignof(std::max_align_t);
+   uint32_t offset_ptr_size = sizeof(bip::offset_ptr<void>);
+   uint32_t segment_manager_size = sizeof(pinnable_mapped_file::segment_manager);
+   uint32_t memory_algorithm_size = sizeof(pinnable_mapped_file::segment_manager::memory_algorithm);
+   uint32_t allocation_alignment = pinnable_mapped_file::segment_manager::memory_algorithm::Alignment;
+   uint32_t allocation_overhead = pinnable_mapped_file::segment_manager::memory_algorithm::PayloadPerAllocation;
+
+   bool recorded() const { return format != 0; }
+
+   bool operator==(const segment_layout& other) const {
+      return !memcmp(this, &other, sizeof(segment_layout));
+   }
+   bool operator!=(const segment_layout& other) const {
+      return !(*this == other);
+   }
+} __attribute__ ((packed));
+
+/**
+ * Ranges of boost versions, each as major * 1000 + minor (BOOST_VERSION / 100), whose segment
+ * manager, rbtree_best_fit allocator and iset_index store their data in the same way, so that
+ * a database written with one version in a range can be opened with the others.  Their sizes do
+ * not reveal every change to these, so a version is only added after its boost interprocess
+ * headers have been compared with those of the other versions in the range.  Releases that
+ * differ only in the patch version always share the layout.
+ *
+ * No pair of boost minor versions has been compared yet, so the list is empty: a database
+ * survives a compiler upgrade or a boost patch release, but still has to be rebuilt when boost
+ * moves to another minor version.
+ */
+struct boost_version_range {
+   unsigned first;
+   unsigned last;
+};
+constexpr std::array<boost_version_range, 0> same_segment_boost_versions = {};
+
 struct environment  {
    environment() {
       strncpy(compiler, __VERSION__, sizeof(compiler)-1);
@@ -53,7 +122,8 @@ struct environment  {
 #endif
 
    unsigned boost_version = BOOST_VERSION;
-   uint8_t reserved[512] = {};
+   segment_layout layout;
+   uint8_t reserved[512 - sizeof(segment_layout)] = {};
    char compiler[256] = {};
 
    bool operator==(const environment& other) {
@@ -62,8 +132,35 @@ struct environment  {
    bool operator!=(const environment& other) {
       return !(*this == other);
    }
+
+   /**
+    * Whether a database created in environment other can be used in this one.  When both
+    * recorded their segment layout, the layout, OS, and architecture have to match, and the
+    * boost versions must share the segment layout (see same_segment_boost_versions); the
+    * compiler and build type may differ.  Otherwise the environments must be identical, as
+    * before the layout was recorded.
+    */
+   bool is_compatible(const environment& other) const {
+      if(layout.recorded() && other.layout.recorded())
+         return os == other.os && arch == other.arch && layout == other.layout && same_segment_boost(other.boost_version);
+      environment lhs = *this, rhs = other;
+      lhs.layout = rhs.layout = segment_layout{segment_layout::zero_t{}};
+      return lhs == rhs;
+   }
+
+   bool same_segment_boost(unsigned other_boost_version) const {
+      const unsigned minor = boost_version / 100, other_minor = other_boost_version / 100;
+      if(minor == other_minor)
+         return true;
+      for(const boost_version_range& range : same_segment_boost_versions)
+         if(range.first <= minor && minor <= range.last && range.first <= other_minor && other_minor <= range.last)
+            return true;
+      return false;
+   }
 } __attribute__ ((packed));
 
+static_assert(offsetof(environment, compiler) == 519, "environment layout must not change");
+
 struct db_header  {
    uint64_t id = header_id;
    bool dirty = false;
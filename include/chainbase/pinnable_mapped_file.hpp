@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <system_error>
 #include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
@@ -24,7 +25,9 @@ enum db_error_code {
    bad_header,
    no_access,
    aborted,
-   no_mlock
+   no_mlock,
+   bad_checksum,
+   no_speculation
 };
 
 const std::error_category& chainbase_error_category();
@@ -46,10 +49,19 @@ class pinnable_mapped_file {
       enum map_mode {
          mapped,
          heap,
-         locked
+         locked,
+         lazy     //like heap, but each page is loaded from the file on first access while the rest load in the background;
+                  //a chunk that does not match its checksums is only found when it is loaded, and is then filled with
+                  //zeros, so wait_for_load must succeed before the contents of the database can be trusted; without a
+                  //userfaultfd that also serves faults taken in the kernel, the file is loaded up front as in heap mode
       };
 
-      pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode, std::vector<std::string> hugepage_paths);
+      //file_name names the data and checksum files in dir, so that a database can have several segments.
+      //An immutable file is opened read only, and always read through the page cache that the processes
+      //opening it share: heap and locked mode read it all into the page cache (locked mode also locks it
+      //there), and lazy mode lets the kernel read it in the background.
+      pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode, std::vector<std::string> hugepage_paths,
+                           const std::string& file_name = "shared_memory", bool immutable = false);
       pinnable_mapped_file(pinnable_mapped_file&& o);
       pinnable_mapped_file& operator=(pinnable_mapped_file&&);
       pinnable_mapped_file(const pinnable_mapped_file&) = delete;
@@ -58,21 +70,61 @@ class pinnable_mapped_file {
 
       segment_manager* get_segment_manager() const { return _segment_manager;}
 
+      //pages of one size holding part of the database in memory
+      struct backing_region {
+         size_t page_size = 0;
+         size_t size = 0;
+      };
+
+      //the pages that the database is loaded into in heap, locked and lazy mode, in order of address; empty
+      //when the database is read from the file, as in mapped mode
+      const std::vector<backing_region>& memory_backing() const { return _memory_backing; }
+
+      //copy-on-write speculation, only available in mapped mode (see database::start_speculation)
+      void start_speculation();
+      void commit_speculation();
+      void discard_speculation();
+      bool is_speculating() const { return _speculating; }
+
+      //in lazy mode, blocks until the whole file has been loaded, and throws if a chunk did not match its
+      //checksums or could not be loaded
+      void wait_for_load();
+
    private:
       void                                          set_mapped_file_db_dirty(bool);
       void                                          load_database_file(boost::asio::io_service& sig_ios);
+      void                                          warm_page_cache(map_mode mode);
       void                                          save_database_file();
       bool                                          all_zeros(char* data, size_t sz);
-      bip::mapped_region                            get_huge_region(const std::vector<std::string>& huge_paths);
+      static void                                   verify_checksums(const bfs::path& checksum_file_path, const std::string& database_name,
+                                                                     const char* data, size_t size);
+      static std::vector<uint64_t>                  read_checksums(const bfs::path& checksum_file_path, const std::string& database_name, size_t size);
+      static bool                                   chunk_matches(const std::vector<uint64_t>& checksums, const char* data, size_t chunk);
+      void                                          write_checksums(const char* data, size_t size, const std::vector<bool>& written);
+      std::vector<bool>                             read_hot_chunks(size_t chunk_count) const;
+      void                                          write_hot_chunks(const std::vector<bool>& hot) const;
+      void                                          record_hot_chunks();
+      void                                          map_huge_region(const std::vector<std::string>& huge_paths);
+      void                                          remap_file(bool shared);
 
       bip::file_lock                                _mapped_file_lock;
       bfs::path                                     _data_file_path;
+      bfs::path                                     _checksum_file_path;
+      bfs::path                                     _hot_chunks_file_path;
       std::string                                   _database_name;
       bool                                          _writable;
+      map_mode                                      _mode;
+      bool                                          _speculating = false;
+      bool                                          _written_back_partly = false;   //a commit of the speculation failed while writing back
 
       bip::file_mapping                             _file_mapping;
       bip::mapped_region                            _file_mapped_region;
       bip::mapped_region                            _mapped_region;
+      std::vector<bip::mapped_region>               _tail_regions;   //mapped right after _mapped_region, with smaller pages
+      std::vector<backing_region>                   _memory_backing;
+
+      class lazy_loader;
+      std::unique_ptr<lazy_loader>                  _lazy_loader;
 
 #ifdef _WIN32
       bip::permissions                              _db_permissions;
@@ -85,6 +137,12 @@ class pinnable_mapped_file {
       constexpr static unsigned                     _db_size_multiple_requirement = 1024*1024; //1MB
 };
 
+//Copies the database in src_dir, with its segments, checksums and hot chunks, to dst_dir, which must not
+//contain them yet.  Where the filesystem supports reflinks the copies share their blocks with the originals
+//until either is changed; elsewhere only the data of the sparse files is copied.  The database must have
+//been closed cleanly, and is locked while it is copied, so it must not be open for writing.
+void clone_database(const bfs::path& src_dir, const bfs::path& dst_dir);
+
 std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runtime);
 std::ostream& operator<<(std::ostream& osm, pinnable_mapped_file::map_mode m);
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boost/multi_index_container_fwd.hpp>
+#include <boost/multi_index/ranked_index_fwd.hpp>
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/avltree.hpp>
 #include <boost/intrusive/slist.hpp>
@@ -13,10 +14,23 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/core/demangle.hpp>
 #include <boost/interprocess/interprocess_fwd.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <type_traits>
 #include <sstream>
+#include <string>
+#include <unordered_set>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace chainbase {
 
@@ -47,6 +61,59 @@ namespace chainbase {
       T _item;
    };
 
+   // A ranked_unique index that also maintains an aggregate of the elements in
+   // every subtree, so that the aggregate of any range can be found in O(log n).
+   //
+   // Aggregate must provide:
+   //  - value_type, which is stored in every node and must not allocate
+   //  - static value_type identity()
+   //  - static value_type lift(const T&), the contribution of a single element
+   //  - static value_type combine(const value_type&, const value_type&), which must
+   //    be associative and commutative.
+   template<typename Aggregate, typename... Args>
+   struct aggregated_unique : boost::multi_index::ranked_unique<Args...> {
+      using aggregate_type = Aggregate;
+   };
+
+   template<typename KeyExtractor>
+   struct sum_of {
+      using value_type = std::decay_t<typename KeyExtractor::result_type>;
+      static value_type identity() { return value_type(); }
+      template<typename T>
+      static value_type lift(const T& t) { return KeyExtractor{}(t); }
+      static value_type combine(const value_type& lhs, const value_type& rhs) { return lhs + rhs; }
+   };
+
+   template<typename KeyExtractor>
+   struct min_of {
+      using value_type = std::decay_t<typename KeyExtractor::result_type>;
+      static value_type identity() { return std::numeric_limits<value_type>::max(); }
+      template<typename T>
+      static value_type lift(const T& t) { return KeyExtractor{}(t); }
+      static value_type combine(const value_type& lhs, const value_type& rhs) { return std::min(lhs, rhs); }
+   };
+
+   template<typename KeyExtractor>
+   struct max_of {
+      using value_type = std::decay_t<typename KeyExtractor::result_type>;
+      static value_type identity() { return std::numeric_limits<value_type>::lowest(); }
+      template<typename T>
+      static value_type lift(const T& t) { return KeyExtractor{}(t); }
+      static value_type combine(const value_type& lhs, const value_type& rhs) { return std::max(lhs, rhs); }
+   };
+
+   template<class Tag>
+   constexpr bool is_ranked_index = false;
+   template<typename... T>
+   constexpr bool is_ranked_index<boost::multi_index::ranked_unique<T...>> = true;
+   template<typename Aggregate, typename... T>
+   constexpr bool is_ranked_index<aggregated_unique<Aggregate, T...>> = true;
+
+   template<class Tag>
+   constexpr bool is_aggregated_index = false;
+   template<typename Aggregate, typename... T>
+   constexpr bool is_aggregated_index<aggregated_unique<Aggregate, T...>> = true;
+
    template<class Tag>
    struct offset_node_base {
       offset_node_base() = default;
@@ -58,35 +125,108 @@ namespace chainbase {
       int _color;
    };
 
-   template<class Tag>
+   // Nodes of a ranked index also store the number of nodes in their subtree, which
+   // set_impl recomputes after every change to the tree (see update_summaries_from).
+   template<typename... T>
+   struct offset_node_base<boost::multi_index::ranked_unique<T...>> {
+      offset_node_base() = default;
+      offset_node_base(const offset_node_base&) {}
+      constexpr offset_node_base& operator=(const offset_node_base&) { return *this; }
+      std::ptrdiff_t _parent;
+      std::ptrdiff_t _left;
+      std::ptrdiff_t _right;
+      int _color;
+      uint64_t _size = 1;
+   };
+
+   // Nodes of an aggregated index keep the contribution of the node itself next to
+   // the aggregate of the subtree, so that the tree algorithms never need the value.
+   template<typename Aggregate, typename... T>
+   struct offset_node_base<aggregated_unique<Aggregate, T...>> {
+      offset_node_base() = default;
+      offset_node_base(const offset_node_base&) {}
+      constexpr offset_node_base& operator=(const offset_node_base&) { return *this; }
+      std::ptrdiff_t _parent;
+      std::ptrdiff_t _left;
+      std::ptrdiff_t _right;
+      int _color;
+      uint64_t _size = 1;
+      typename Aggregate::value_type _own = Aggregate::identity();
+      typename Aggregate::value_type _aggregate = Aggregate::identity();
+   };
+
+   // Nodes link to each other by their offset from the node holding the link, so that a
+   // segment works wherever it is mapped.  Containers whose allocator never hands out memory
+   // that outlives the process can store absolute addresses instead, which saves the
+   // arithmetic on every link that is followed.  This is enabled for std::allocator and can
+   // be specialized for other process-local allocators, such as an arena.
+   template<typename Allocator>
+   constexpr bool uses_absolute_links = false;
+   template<typename T>
+   constexpr bool uses_absolute_links<std::allocator<T>> = true;
+
+   // Links are 1 when null, which is never a valid offset or address.
+   //
+   // An offset leads from one object to another, e.g. from the header in the container to
+   // a node, which pointer arithmetic on the first object may not do.  The compiler would
+   // assume that the result still points into the first object and reorder the accesses
+   // to the two, so the address is computed as an integer instead.
+   template<class Tag, bool Absolute = false>
    struct offset_node_traits {
       using node = offset_node_base<Tag>;
       using node_ptr = node*;
       using const_node_ptr = const node*;
       using color = int;
+      static node_ptr follow(const_node_ptr n, std::ptrdiff_t link) {
+         if(link == 1) return nullptr;
+         if constexpr (Absolute) return (node_ptr)link;
+         else return (node_ptr)((std::uintptr_t)n + link);
+      }
       static node_ptr get_parent(const_node_ptr n) {
-         if(n->_parent == 1) return nullptr;
-         return (node_ptr)((char*)n + n->_parent);
+         return follow(n, n->_parent);
       }
       static void set_parent(node_ptr n, node_ptr parent) {
-         if(parent == nullptr) n->_parent = 1;
-         else n->_parent = (char*)parent - (char*)n;
+         set_offset(n, n->_parent, parent);
       }
       static node_ptr get_left(const_node_ptr n) {
-         if(n->_left == 1) return nullptr;
-         return (node_ptr)((char*)n + n->_left);
+         return follow(n, n->_left);
       }
       static void set_left(node_ptr n, node_ptr left) {
-         if(left == nullptr) n->_left = 1;
-         else n->_left = (char*)left - (char*)n;
+         set_offset(n, n->_left, left);
       }
       static node_ptr get_right(const_node_ptr n) {
-         if(n->_right == 1) return nullptr;
-         return (node_ptr)((char*)n + n->_right);
+         return follow(n, n->_right);
       }
       static void set_right(node_ptr n, node_ptr right) {
-         if(right == nullptr) n->_right = 1;
-         else n->_right = (char*)right - (char*)n;
+         set_offset(n, n->_right, right);
+      }
+      static void set_offset(node_ptr n, std::ptrdiff_t& field, node_ptr target) {
+         if(target == nullptr) field = 1;
+         else if constexpr (Absolute) field = (std::ptrdiff_t)target;
+         else field = (char*)target - (char*)n;
+      }
+      // ranked index
+      static uint64_t get_size(const_node_ptr n) {
+         return n ? n->_size : 0;
+      }
+      // aggregated index
+      static auto get_aggregate(const_node_ptr n) {
+         return n ? n->_aggregate : Tag::aggregate_type::identity();
+      }
+      // Recomputes the size and aggregate of n from its children, which must be up to date.
+      // Setting a link never does this, so the tree algorithms cannot leave a summary
+      // wrong by relinking nodes in an order that this does not expect.  Does nothing
+      // for indices that are not ranked.
+      static void update_summary(node_ptr n) {
+         if constexpr (is_ranked_index<Tag>) {
+            const_node_ptr left = get_left(n);
+            const_node_ptr right = get_right(n);
+            n->_size = 1 + get_size(left) + get_size(right);
+            if constexpr (is_aggregated_index<Tag>) {
+               using aggregate_type = typename Tag::aggregate_type;
+               n->_aggregate = aggregate_type::combine(aggregate_type::combine(get_aggregate(left), n->_own), get_aggregate(right));
+            }
+         }
       }
       // red-black tree
       static color get_color(node_ptr n) {
@@ -111,14 +251,14 @@ namespace chainbase {
 
       // list
       static node_ptr get_next(const_node_ptr n) { return get_right(n); }
-      static void set_next(node_ptr n, node_ptr next) { set_right(n, next); }
+      static void set_next(node_ptr n, node_ptr next) { set_offset(n, n->_right, next); }
       static node_ptr get_previous(const_node_ptr n) { return get_left(n); }
-      static void set_previous(node_ptr n, node_ptr previous) { set_left(n, previous); }
+      static void set_previous(node_ptr n, node_ptr previous) { set_offset(n, n->_left, previous); }
    };
 
    template<typename Node, typename Tag>
    struct offset_node_value_traits {
-      using node_traits = offset_node_traits<Tag>;
+      using node_traits = offset_node_traits<Tag, uses_absolute_links<typename Node::allocator_type>>;
       using node_ptr = typename node_traits::node_ptr;
       using const_node_ptr = typename node_traits::const_node_ptr;
       using value_type = typename Node::value_type;
@@ -143,6 +283,8 @@ namespace chainbase {
    struct index_tag_impl { using type = void; };
    template<template<typename...> class Index, typename Tag, typename... T>
    struct index_tag_impl<Index<boost::multi_index::tag<Tag>, T...>> { using type = Tag; };
+   template<typename Aggregate, typename Tag, typename... T>
+   struct index_tag_impl<aggregated_unique<Aggregate, boost::multi_index::tag<Tag>, T...>> { using type = Tag; };
    template<typename Index>
    using index_tag = typename index_tag_impl<Index>::type;
 
@@ -163,6 +305,10 @@ namespace chainbase {
    constexpr bool is_valid_index = false;
    template<typename... T>
    constexpr bool is_valid_index<boost::multi_index::ordered_unique<T...>> = true;
+   template<typename... T>
+   constexpr bool is_valid_index<boost::multi_index::ranked_unique<T...>> = true;
+   template<typename Aggregate, typename... T>
+   constexpr bool is_valid_index<aggregated_unique<Aggregate, T...>> = true;
 
    template<typename Node, typename Tag>
    using list_base = boost::intrusive::slist<
@@ -180,12 +326,132 @@ namespace chainbase {
       }
    }
 
+   inline void prefetch_node(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+      __builtin_prefetch(p);
+#else
+      (void)p;
+#endif
+   }
+
+   // Join and split of AVL trees.  A subtree is a root and the height of the tree below
+   // it.  Heights are not stored in the nodes, but the height of a child follows from
+   // the height of its parent and the balance of the parent, so only the height of the
+   // whole tree has to be measured.  Joining two trees with a node between them walks
+   // down the taller tree only as far as the height of the shorter one, so a split,
+   // which joins the pieces that it cuts off on the way down, is O(log n) in total.
+   //
+   // The summary of a node is recomputed when it is linked, after its children are
+   // complete, which keeps the sizes and aggregates of ranked and aggregated indices up
+   // to date.  The parent of the root of a result is left for the caller to set.
+   template<typename NodeTraits>
+   struct avl_join {
+      using node_ptr = typename NodeTraits::node_ptr;
+      struct subtree {
+         node_ptr root = nullptr;
+         int height = 0;
+      };
+
+      static subtree whole(node_ptr root) {
+         int height = 0;
+         for(node_ptr n = root; n; n = NodeTraits::get_balance(n) == NodeTraits::negative() ? NodeTraits::get_left(n) : NodeTraits::get_right(n)) {
+            ++height;
+         }
+         return { root, height };
+      }
+      static subtree left(subtree t) {
+         return { NodeTraits::get_left(t.root), t.height - 1 - (NodeTraits::get_balance(t.root) == NodeTraits::positive()) };
+      }
+      static subtree right(subtree t) {
+         return { NodeTraits::get_right(t.root), t.height - 1 - (NodeTraits::get_balance(t.root) == NodeTraits::negative()) };
+      }
+
+      // Makes k the root of l and r, whose heights differ by at most one.
+      static subtree link(subtree l, node_ptr k, subtree r) {
+         NodeTraits::set_left(k, l.root);
+         NodeTraits::set_right(k, r.root);
+         if(l.root) NodeTraits::set_parent(l.root, k);
+         if(r.root) NodeTraits::set_parent(r.root, k);
+         NodeTraits::set_balance(k, r.height > l.height ? NodeTraits::positive() :
+                                    r.height < l.height ? NodeTraits::negative() : NodeTraits::zero());
+         NodeTraits::update_summary(k);
+         return { k, std::max(l.height, r.height) + 1 };
+      }
+      // Like link, when r is two levels taller than l.  Rotates to restore the balance.
+      static subtree link_heavy_right(subtree l, node_ptr k, subtree r) {
+         subtree rl = left(r), rr = right(r);
+         if(rl.height <= rr.height) return link(link(l, k, rl), r.root, rr);
+         subtree rll = left(rl), rlr = right(rl);
+         subtree new_left = link(l, k, rll);
+         subtree new_right = link(rlr, r.root, rr);
+         return link(new_left, rl.root, new_right);
+      }
+      // Like link, when l is two levels taller than r.
+      static subtree link_heavy_left(subtree l, node_ptr k, subtree r) {
+         subtree ll = left(l), lr = right(l);
+         if(lr.height <= ll.height) return link(ll, l.root, link(lr, k, r));
+         subtree lrl = left(lr), lrr = right(lr);
+         subtree new_left = link(ll, l.root, lrl);
+         subtree new_right = link(lrr, k, r);
+         return link(new_left, lr.root, new_right);
+      }
+
+      // Returns a tree of the nodes of l, then k, then the nodes of r.
+      static subtree join(subtree l, node_ptr k, subtree r) {
+         if(l.height > r.height + 1) return join_into_left(l, k, r);
+         if(r.height > l.height + 1) return join_into_right(l, k, r);
+         return link(l, k, r);
+      }
+      // Walks down the right spine of l to a subtree that is not much taller than r
+      static subtree join_into_left(subtree l, node_ptr k, subtree r) {
+         subtree ll = left(l), lr = right(l);
+         subtree t = lr.height > r.height + 1 ? join_into_left(lr, k, r) : link(lr, k, r);
+         return t.height <= ll.height + 1 ? link(ll, l.root, t) : link_heavy_right(ll, l.root, t);
+      }
+      static subtree join_into_right(subtree l, node_ptr k, subtree r) {
+         subtree rl = left(r), rr = right(r);
+         subtree t = rl.height > l.height + 1 ? join_into_right(l, k, rl) : link(l, k, rl);
+         return t.height <= rr.height + 1 ? link(t, r.root, rr) : link_heavy_left(t, r.root, rr);
+      }
+      // Returns a tree of the nodes of l, then the nodes of r.
+      static subtree join(subtree l, subtree r) {
+         if(!r.root) return l;
+         auto [first, rest] = remove_first(r);
+         return join(l, first, rest);
+      }
+      static std::pair<node_ptr, subtree> remove_first(subtree t) {
+         subtree l = left(t), r = right(t);
+         if(!l.root) return { t.root, r };
+         auto [first, rest] = remove_first(l);
+         return { first, join(rest, t.root, r) };
+      }
+
+      // Splits t into the nodes for which goes_left(node) is true, and the rest.
+      // goes_left must be true for a prefix of the nodes in order.
+      template<typename F>
+      static std::pair<subtree, subtree> split(subtree t, const F& goes_left) {
+         if(!t.root) return {};
+         subtree l = left(t), r = right(t);
+         if(goes_left(t.root)) {
+            auto [rl, rr] = split(r, goes_left);
+            return { join(l, t.root, rl), rr };
+         } else {
+            auto [ll, lr] = split(l, goes_left);
+            return { ll, join(lr, t.root, r) };
+         }
+      }
+   };
+
    template<typename T, typename Allocator, typename... Indices>
    class undo_index;
-  
+
    template<typename Node, typename OrderedIndex>
    struct set_impl : private set_base<Node, OrderedIndex> {
       using base_type = set_base<Node, OrderedIndex>;
+      set_impl() = default;
+      set_impl(set_impl&& other) noexcept {
+         base_type::swap(other);
+      }
       // Allow compatible keys to match multi_index
       template<typename K>
       auto find(K&& k) const {
@@ -203,6 +469,173 @@ namespace chainbase {
       auto equal_range(K&& k) const {
          return base_type::equal_range(static_cast<K&&>(k), this->key_comp());
       }
+      // Looks up every key in [first, last) and writes a pointer to the matching
+      // value (or nullptr) to out, in input order.  Up to find_many_width searches
+      // are advanced in lock step, so that the cache misses of independent tree
+      // walks overlap instead of being paid one after another.  The keys are read
+      // through saved copies of the iterator, so KeyIter must be a forward iterator.
+      template<typename KeyIter, typename OutIter>
+      OutIter find_many(KeyIter first, KeyIter last, OutIter out) const {
+         static_assert(std::is_base_of_v<std::forward_iterator_tag, typename std::iterator_traits<KeyIter>::iterator_category>,
+                       "find_many requires forward iterators over the keys");
+         using node_traits = typename base_type::node_traits;
+         using value_traits = typename base_type::value_traits;
+         using const_node_ptr = typename node_traits::const_node_ptr;
+         const const_node_ptr header = this->header_ptr();
+         const const_node_ptr root = node_traits::get_parent(header);
+         const auto& comp = this->key_comp();
+         typename base_type::key_of_value key_of;
+         KeyIter keys[find_many_width];
+         const_node_ptr current[find_many_width];
+         const_node_ptr candidate[find_many_width];
+         while(first != last) {
+            std::size_t width = 0;
+            for(; width < find_many_width && first != last; ++width, ++first) {
+               keys[width] = first;
+               current[width] = root;
+               candidate[width] = header;
+            }
+            // Each pass takes one step down the tree for every search that is still
+            // active, and prefetches the node that the next pass will visit.
+            for(bool active = true; active;) {
+               active = false;
+               for(std::size_t i = 0; i < width; ++i) {
+                  const_node_ptr n = current[i];
+                  if(!n) continue;
+                  if(!comp(key_of(*value_traits::to_value_ptr(n)), *keys[i])) {
+                     candidate[i] = n;
+                     n = node_traits::get_left(n);
+                  } else {
+                     n = node_traits::get_right(n);
+                  }
+                  current[i] = n;
+                  if(n) {
+                     prefetch_node(&*n);
+                     prefetch_node(&*value_traits::to_value_ptr(n));
+                     active = true;
+                  }
+               }
+            }
+            for(std::size_t i = 0; i < width; ++i) {
+               const_node_ptr n = candidate[i];
+               if(n != header && !comp(*keys[i], key_of(*value_traits::to_value_ptr(n)))) {
+                  *out = &*value_traits::to_value_ptr(n);
+               } else {
+                  *out = nullptr;
+               }
+               ++out;
+            }
+         }
+         return out;
+      }
+      static constexpr std::size_t find_many_width = 8;
+      static decltype(auto) key_of(const typename Node::value_type& v) {
+         return typename base_type::key_of_value{}(v);
+      }
+
+      // Positional access.  These are only available for ranked_unique indices, which
+      // keep the size of every subtree, and take logarithmic time.
+      //
+      // Returns the element at position n in index order, or end() if n >= size().
+      auto nth(std::size_t n) const {
+         static_assert(is_ranked_index<OrderedIndex>, "nth requires a ranked_unique index");
+         using node_traits = typename base_type::node_traits;
+         auto x = node_traits::get_parent(this->header_ptr());
+         while(x) {
+            auto left = node_traits::get_left(x);
+            auto left_size = node_traits::get_size(left);
+            if(n < left_size) {
+               x = left;
+            } else if(n == left_size) {
+               return base_type::iterator_to(*base_type::value_traits::to_value_ptr(x));
+            } else {
+               n -= left_size + 1;
+               x = node_traits::get_right(x);
+            }
+         }
+         return base_type::end();
+      }
+      // Returns the number of elements that precede iter.  rank(end()) == size().
+      std::size_t rank(typename base_type::const_iterator iter) const {
+         static_assert(is_ranked_index<OrderedIndex>, "rank requires a ranked_unique index");
+         using node_traits = typename base_type::node_traits;
+         const auto header = this->header_ptr();
+         auto x = iter.pointed_node();
+         if(x == header) return base_type::size();
+         std::size_t result = node_traits::get_size(node_traits::get_left(x));
+         for(auto parent = node_traits::get_parent(x); parent != header; x = parent, parent = node_traits::get_parent(x)) {
+            if(node_traits::get_right(parent) == x) {
+               result += node_traits::get_size(node_traits::get_left(parent)) + 1;
+            }
+         }
+         return result;
+      }
+      template<typename K>
+      std::size_t lower_bound_rank(K&& k) const {
+         return rank(lower_bound(static_cast<K&&>(k)));
+      }
+      template<typename K>
+      std::size_t upper_bound_rank(K&& k) const {
+         return rank(upper_bound(static_cast<K&&>(k)));
+      }
+      // The aggregate of all elements.  Only available for aggregated_unique indices.
+      auto aggregate() const {
+         static_assert(is_aggregated_index<OrderedIndex>, "aggregate requires an aggregated_unique index");
+         using node_traits = typename base_type::node_traits;
+         return node_traits::get_aggregate(node_traits::get_parent(this->header_ptr()));
+      }
+      // The aggregate of the elements in [first, last), in O(log n).  The aggregate of
+      // the keys in [a, b) is aggregate(lower_bound(a), lower_bound(b)).
+      auto aggregate(typename base_type::const_iterator first, typename base_type::const_iterator last) const {
+         static_assert(is_aggregated_index<OrderedIndex>, "aggregate requires an aggregated_unique index");
+         using node_traits = typename base_type::node_traits;
+         using aggregate_type = typename OrderedIndex::aggregate_type;
+         const std::size_t lo = rank(first);
+         const std::size_t hi = rank(last);
+         auto result = aggregate_type::identity();
+         // Find the highest node in the range.  Everything else in the range
+         // is in its left or right subtree.
+         auto x = node_traits::get_parent(this->header_ptr());
+         std::size_t offset = 0; // The position of the first element in the subtree of x
+         std::size_t pos = 0;
+         while(x) {
+            pos = offset + node_traits::get_size(node_traits::get_left(x));
+            if(pos < lo) {
+               offset = pos + 1;
+               x = node_traits::get_right(x);
+            } else if(pos >= hi) {
+               x = node_traits::get_left(x);
+            } else {
+               break;
+            }
+         }
+         if(!x || lo >= hi) return result;
+         // The part of the left subtree that is at or after lo
+         for(auto y = node_traits::get_left(x); y;) {
+            std::size_t ypos = offset + node_traits::get_size(node_traits::get_left(y));
+            if(ypos >= lo) {
+               result = aggregate_type::combine(aggregate_type::combine(y->_own, node_traits::get_aggregate(node_traits::get_right(y))), result);
+               y = node_traits::get_left(y);
+            } else {
+               offset = ypos + 1;
+               y = node_traits::get_right(y);
+            }
+         }
+         result = aggregate_type::combine(result, x->_own);
+         // The part of the right subtree that is before hi
+         offset = pos + 1;
+         for(auto y = node_traits::get_right(x); y;) {
+            std::size_t ypos = offset + node_traits::get_size(node_traits::get_left(y));
+            if(ypos < hi) {
+               result = aggregate_type::combine(result, aggregate_type::combine(node_traits::get_aggregate(node_traits::get_left(y)), y->_own));
+               offset = ypos + 1;
+               y = node_traits::get_right(y);
+            } else {
+               y = node_traits::get_left(y);
+            }
+         }
+         return result;
+      }
       using base_type::begin;
       using base_type::end;
       using base_type::rbegin;
@@ -212,6 +645,268 @@ namespace chainbase {
       using base_type::empty;
       template<typename T, typename Allocator, typename... Indices>
       friend class undo_index;
+    private:
+      using value_type = typename Node::value_type;
+      using node_traits = typename base_type::node_traits;
+      using node_ptr = typename node_traits::node_ptr;
+
+      // Every modification of the tree goes through these wrappers.  For a ranked
+      // index, they recompute the summaries from the node where the tree algorithm
+      // linked or unlinked a node up to the root once it is done, whatever order it
+      // relinked the nodes in (see update_summaries_from).
+      auto insert_unique(value_type& v) {
+         prepare_insert(v);
+         auto result = base_type::insert_unique(v);
+         if(result.second) update_summaries_from(base_type::value_traits::to_node_ptr(v));
+         return result;
+      }
+      auto insert_equal(value_type& v) {
+         prepare_insert(v);
+         auto result = base_type::insert_equal(v);
+         update_summaries_from(base_type::value_traits::to_node_ptr(v));
+         return result;
+      }
+      auto insert_before(typename base_type::const_iterator pos, value_type& v) {
+         prepare_insert(v);
+         auto result = base_type::insert_before(pos, v);
+         update_summaries_from(base_type::value_traits::to_node_ptr(v));
+         return result;
+      }
+      void push_back(value_type& v) {
+         prepare_insert(v);
+         base_type::push_back(v);
+         update_summaries_from(base_type::value_traits::to_node_ptr(v));
+      }
+      auto erase(typename base_type::const_iterator iter) {
+         if constexpr (is_ranked_index<OrderedIndex>) {
+            // The lowest node that the erase changes is the parent of the node that is
+            // unlinked from its position: z itself, or its successor when z has two
+            // children, which is then moved into the place of z.
+            const node_ptr z = iter.pointed_node();
+            node_ptr lowest = node_traits::get_parent(z);
+            if(node_traits::get_left(z) && node_traits::get_right(z)) {
+               node_ptr y = node_traits::get_right(z);
+               while(node_traits::get_left(y)) y = node_traits::get_left(y);
+               lowest = node_traits::get_parent(y) == z ? y : node_traits::get_parent(y);
+            }
+            auto result = base_type::erase(iter);
+            update_summaries_from(lowest);
+            return result;
+         } else {
+            return base_type::erase(iter);
+         }
+      }
+      template<typename Disposer>
+      void erase_and_dispose(typename base_type::const_iterator first, typename base_type::const_iterator last, Disposer&& d) {
+         if constexpr (is_ranked_index<OrderedIndex>) {
+            while(first != last) {
+               auto& v = const_cast<value_type&>(*first++);
+               erase(base_type::iterator_to(v));
+               d(&v);
+            }
+         } else {
+            base_type::erase_and_dispose(first, last, static_cast<Disposer&&>(d));
+         }
+      }
+      // Summaries do not matter in a tree that is being taken apart.
+      template<typename Disposer>
+      void clear_and_dispose(Disposer&& d) {
+         base_type::clear_and_dispose(static_cast<Disposer&&>(d));
+      }
+      void prepare_insert(value_type& v) {
+         if constexpr (is_aggregated_index<OrderedIndex>) {
+            base_type::value_traits::to_node_ptr(v)->_own = OrderedIndex::aggregate_type::lift(v);
+         }
+      }
+      // Recomputes the summaries of n and of every node above it, after a tree algorithm
+      // linked or unlinked a node just below n and rebalanced the tree.  The rotations
+      // that rebalance it only move nodes on that path and their children, and keep the
+      // subtrees below those children intact, so each child that is not on the path is
+      // recomputed from its own children before the node above it.
+      void update_summaries_from(node_ptr n) {
+         if constexpr (is_ranked_index<OrderedIndex>) {
+            const node_ptr header = this->header_ptr();
+            for(node_ptr from = nullptr; n != header; from = n, n = node_traits::get_parent(n)) {
+               if(node_ptr left = node_traits::get_left(n); left && left != from) node_traits::update_summary(left);
+               if(node_ptr right = node_traits::get_right(n); right && right != from) node_traits::update_summary(right);
+               node_traits::update_summary(n);
+            }
+         }
+      }
+      // Moves the values in [first, end()) to right, which must be empty.  The tree is cut
+      // along the path to first and the pieces are joined back together, which takes
+      // O(log n) time.  The values moved must also be counted, which is O(log n) for a
+      // ranked index, but linear in the number moved for the others.  Callers that can
+      // count them more cheaply use split_uncounted.
+      void split(typename base_type::const_iterator first, set_impl& right) noexcept {
+         const std::size_t total = base_type::size();
+         split_uncounted(first, right);
+         const node_ptr moved_root = node_traits::get_parent(right.header_ptr());
+         std::size_t moved;
+         if constexpr (is_ranked_index<OrderedIndex>) moved = node_traits::get_size(moved_root);
+         else moved = count_subtree(moved_root);
+         set_size(total - moved);
+         right.set_size(moved);
+      }
+      // Like split, in O(log n), but without counting the values moved.  The sizes of both
+      // trees are wrong until the caller sets them with set_size, and until then only their
+      // links may be used.
+      void split_uncounted(typename base_type::const_iterator first, set_impl& right) noexcept {
+         assert(right.empty());
+         if(first == base_type::end()) return;
+         const std::size_t total = base_type::size();
+         const auto& first_key = key_of(*first);
+         auto [l, r] = join_algorithms::split(join_algorithms::whole(node_traits::get_parent(this->header_ptr())), [&](node_ptr n) {
+            return this->key_comp()(key_of(*base_type::value_traits::to_value_ptr(n)), first_key);
+         });
+         set_tree(l.root, total);
+         right.set_tree(r.root, 0);
+      }
+      void set_size(std::size_t count) noexcept {
+         this->sz_traits().set_size(count);
+      }
+      // Moves every value of right to the end of this tree, in O(log n).  The values of
+      // right must all be ordered after the values of this tree.
+      void join(set_impl& right) noexcept {
+         assert(base_type::empty() || right.empty() ||
+                this->key_comp()(key_of(*base_type::rbegin()), key_of(*right.begin())));
+         const std::size_t total = base_type::size() + right.size();
+         auto result = join_algorithms::join(join_algorithms::whole(node_traits::get_parent(this->header_ptr())),
+                                             join_algorithms::whole(node_traits::get_parent(right.header_ptr())));
+         right.base_type::clear();
+         set_tree(result.root, total);
+      }
+      using join_algorithms = avl_join<node_traits>;
+      static std::size_t count_subtree(node_ptr n) {
+         std::size_t result = 0;
+         for(; n; n = node_traits::get_right(n)) result += 1 + count_subtree(node_traits::get_left(n));
+         return result;
+      }
+      // Makes the header point to the tree rooted at root.  The nodes are not touched
+      // except for the parent of the root.
+      void set_tree(node_ptr root, std::size_t count) noexcept {
+         base_type::clear();
+         if(!root) return;
+         const node_ptr header = this->header_ptr();
+         node_traits::set_parent(root, header);
+         node_traits::set_parent(header, root);
+         node_ptr leftmost = root, rightmost = root;
+         while(node_ptr n = node_traits::get_left(leftmost)) leftmost = n;
+         while(node_ptr n = node_traits::get_right(rightmost)) rightmost = n;
+         node_traits::set_left(header, leftmost);
+         node_traits::set_right(header, rightmost);
+         this->sz_traits().set_size(count);
+      }
+      // Replaces the contents of the empty tree with the values in [first, first + count),
+      // which must be sorted and unique, linked as a balanced tree.
+      void build_balanced(value_type* const* first, std::size_t count) noexcept {
+         assert(base_type::empty());
+         if(count == 0) return;
+         const node_ptr header = this->header_ptr();
+         const node_ptr root = build_subtree(first, count).first;
+         node_traits::set_parent(root, header);
+         node_traits::set_parent(header, root);
+         node_traits::set_left(header, base_type::value_traits::to_node_ptr(*first[0]));
+         node_traits::set_right(header, base_type::value_traits::to_node_ptr(*first[count - 1]));
+         this->sz_traits().set_size(count);
+      }
+      // Returns the root of the subtree and its height.  The two halves of each subtree
+      // differ in size by at most one, so their heights differ by at most one.
+      std::pair<node_ptr, int> build_subtree(value_type* const* first, std::size_t count) noexcept {
+         if(count == 0) return { nullptr, 0 };
+         const std::size_t mid = count / 2;
+         auto [left, left_height] = build_subtree(first, mid);
+         auto [right, right_height] = build_subtree(first + mid + 1, count - mid - 1);
+         value_type& v = *first[mid];
+         node_ptr n = base_type::value_traits::to_node_ptr(v);
+         if constexpr (is_aggregated_index<OrderedIndex>) n->_own = OrderedIndex::aggregate_type::lift(v);
+         node_traits::set_left(n, left);
+         node_traits::set_right(n, right);
+         if(left) node_traits::set_parent(left, n);
+         if(right) node_traits::set_parent(right, n);
+         node_traits::set_balance(n, right_height > left_height ? node_traits::positive() :
+                                     right_height < left_height ? node_traits::negative() : node_traits::zero());
+         node_traits::update_summary(n);
+         return { n, std::max(left_height, right_height) + 1 };
+      }
+      // Must be called when v was changed without moving it in the tree.
+      void update_aggregate(value_type& v) {
+         if constexpr (is_aggregated_index<OrderedIndex>) {
+            node_ptr n = base_type::value_traits::to_node_ptr(v);
+            n->_own = OrderedIndex::aggregate_type::lift(v);
+            for(const node_ptr header = this->header_ptr(); n != header; n = node_traits::get_parent(n)) {
+               node_traits::update_summary(n);
+            }
+         }
+      }
+
+      // Checks the structure of the tree: the parent links, the balance of every node,
+      // the order of the values, the sizes and aggregates kept by ranked and aggregated
+      // indices, and the leftmost node, rightmost node and size kept in the header.
+      // Calls visit(v) for every value, in order.  Returns a description of the first
+      // problem found, or nullptr.  Never follows more links than the tree should have,
+      // so it terminates on a corrupted tree.
+      template<typename Visitor>
+      const char* verify(Visitor&& visit) const {
+         using const_node_ptr = typename node_traits::const_node_ptr;
+         const const_node_ptr header = this->header_ptr();
+         verify_state state;
+         const const_node_ptr root = node_traits::get_parent(header);
+         if(root) verify_subtree(root, header, 0, state, visit);
+         if(state.error) return state.error;
+         if(state.count != base_type::size()) return "the number of nodes does not match the size";
+         const_node_ptr leftmost = root ? base_type::value_traits::to_node_ptr(*state.first) : header;
+         const_node_ptr rightmost = root ? base_type::value_traits::to_node_ptr(*state.last) : header;
+         if(node_traits::get_left(header) != leftmost || node_traits::get_right(header) != rightmost)
+            return "the header does not point to the first and last nodes";
+         return nullptr;
+      }
+      struct verify_state {
+         const value_type* first = nullptr;
+         const value_type* last = nullptr;
+         std::size_t count = 0;
+         const char* error = nullptr;
+      };
+      // Returns the height of the subtree rooted at n.
+      template<typename Visitor>
+      int verify_subtree(typename node_traits::const_node_ptr n, typename node_traits::const_node_ptr parent, int depth, verify_state& state, Visitor& visit) const {
+         // An AVL tree of 2^64 nodes is less than 93 levels deep.
+         constexpr int max_depth = 96;
+         if(node_traits::get_parent(n) != parent) { state.error = "a child does not link to its parent"; return 0; }
+         if(depth >= max_depth || state.count >= base_type::size()) { state.error = "the tree has more nodes than its size, or a cycle"; return 0; }
+         int left_height = 0, right_height = 0;
+         if(auto left = node_traits::get_left(n)) left_height = verify_subtree(left, n, depth + 1, state, visit);
+         if(state.error) return 0;
+         const value_type& v = *base_type::value_traits::to_value_ptr(n);
+         if(state.last && !this->value_comp()(*state.last, v)) { state.error = "the values are not in strictly increasing order"; return 0; }
+         if(!state.first) state.first = &v;
+         state.last = &v;
+         ++state.count;
+         visit(v);
+         if(auto right = node_traits::get_right(n)) right_height = verify_subtree(right, n, depth + 1, state, visit);
+         if(state.error) return 0;
+         const int balance = node_traits::get_balance(const_cast<node_ptr>(n));
+         if(balance != right_height - left_height || balance < -1 || balance > 1) { state.error = "a node is not balanced, or its balance is wrong"; return 0; }
+         if constexpr (is_ranked_index<OrderedIndex>) {
+            if(n->_size != 1 + node_traits::get_size(node_traits::get_left(n)) + node_traits::get_size(node_traits::get_right(n))) {
+               state.error = "the subtree size of a node is wrong";
+               return 0;
+            }
+         }
+         if constexpr (is_aggregated_index<OrderedIndex>) {
+            using aggregate_type = typename OrderedIndex::aggregate_type;
+            // Floating point sums depend on the order in which they were combined.
+            if constexpr (!std::is_floating_point_v<typename aggregate_type::value_type>) {
+               if(!(n->_own == aggregate_type::lift(v)) ||
+                  !(n->_aggregate == aggregate_type::combine(aggregate_type::combine(node_traits::get_aggregate(node_traits::get_left(n)), n->_own),
+                                                             node_traits::get_aggregate(node_traits::get_right(n))))) {
+                  state.error = "the aggregate of a node is wrong";
+                  return 0;
+               }
+            }
+         }
+         return std::max(left_height, right_height) + 1;
+      }
    };
 
    template<typename T, typename S>
@@ -229,8 +924,14 @@ namespace chainbase {
    template<typename T, typename S>
    auto propagate_allocator(chainbase::chainbase_node_allocator<T, S>& a) { return boost::interprocess::allocator<T, S>{a.get_segment_manager()}; }
 
+   // Whether the allocator can list its free nodes (see chainbase_node_allocator::for_each_free).
+   template<typename A, typename = void>
+   constexpr bool has_free_list = false;
+   template<typename A>
+   constexpr bool has_free_list<A, std::void_t<decltype(std::declval<const A&>().for_each_free(std::declval<bool(*)(const void*)>()))>> = true;
+
    // Similar to boost::multi_index_container with an undo stack.
-   // Indices should be instances of ordered_unique.
+   // Indices should be instances of ordered_unique, ranked_unique, or aggregated_unique.
    template<typename T, typename Allocator, typename... Indices>
    class undo_index {
     public:
@@ -238,20 +939,74 @@ namespace chainbase {
       using value_type = T;
       using allocator_type = Allocator;
 
-      static_assert((... && is_valid_index<Indices>), "Only ordered_unique indices are supported");
+      static_assert((... && is_valid_index<Indices>), "Only ordered_unique, ranked_unique, and aggregated_unique indices are supported");
 
       undo_index() = default;
-      explicit undo_index(const Allocator& a) : _undo_stack{a}, _allocator{a}, _old_values_allocator{a} {}
+      explicit undo_index(const Allocator& a) : _undo_stack{a}, _allocator{a}, _old_values_allocator{a}, _id_table{cache_allocator{a}} {}
       ~undo_index() {
+         set_lookup_cache_size(0);
          dispose_undo();
          clear_impl<1>();
          std::get<0>(_indices).clear_and_dispose([&](pointer p){ dispose_node(*p); });
       }
 
+      // Takes over the contents of other, which is left empty.
+      undo_index(undo_index&& other)
+       : _indices(std::move(other._indices)),
+         _undo_stack(std::move(other._undo_stack)),
+         _old_values(std::move(other._old_values)),
+         _removed_values(std::move(other._removed_values)),
+         _allocator(std::move(other._allocator)),
+         _old_values_allocator(std::move(other._old_values_allocator)),
+         _next_id(other._next_id),
+         _revision(other._revision),
+         _monotonic_revision(other._monotonic_revision),
+         _lookup_cache(std::exchange(other._lookup_cache, nullptr)),
+         _lookup_cache_bits(std::exchange(other._lookup_cache_bits, 0)),
+         _use_id_table(std::exchange(other._use_id_table, false)),
+         _id_table(std::move(other._id_table)),
+         _reclaim_old_after(std::exchange(other._reclaim_old_after, nullptr)),
+         _reclaim_removed_after(std::exchange(other._reclaim_removed_after, nullptr)) {}
+
+      // Returns whether the sizes recorded when this undo_index was constructed match this executable.
+      bool has_expected_layout()const {
+         return sizeof(node) == _size_of_value_type && sizeof(*this) == _size_of_this;
+      }
+
       void validate()const {
-         if( sizeof(node) != _size_of_value_type || sizeof(*this) != _size_of_this )
+         if( !has_expected_layout() )
             BOOST_THROW_EXCEPTION( std::runtime_error("content of memory does not match data expected by executable") );
       }
+
+      // Checks the invariants of the undo_index, e.g. after a crash, and throws
+      // std::runtime_error describing the first problem found:
+      //  - every index is a valid AVL tree, whose values are in order (see set_impl::verify),
+      //  - every index holds exactly the objects of index 0,
+      //  - the undo stack points into the undo lists in order, every saved value belongs
+      //    to a live or removed object, and every removed object is marked as removed,
+      //  - the id table, if enabled, points to exactly the live objects,
+      //  - no node in use is on the free list of its allocator.
+      // The indices are checked in parallel.  This reads every node, so it takes time
+      // proportional to the size of the table.
+      void verify() const {
+         for_each_index_parallel([&](auto n) {
+            constexpr int N = decltype(n)::value;
+            const auto& idx0 = std::get<0>(_indices);
+            const char* error = std::get<N>(_indices).verify([&](const value_type& v) {
+               if constexpr (N == 0) {
+                  if(!(v.id < _next_id)) verify_failed(N, "an object has an id that was not assigned yet");
+               } else {
+                  auto iter = idx0.find(v.id);
+                  if(iter == idx0.end() || &*iter != &v) verify_failed(N, "an object is missing from index 0");
+               }
+            });
+            if(error) verify_failed(N, error);
+            if(std::get<N>(_indices).size() != idx0.size()) verify_failed(N, "the index does not hold every object");
+         });
+         verify_undo_lists();
+         verify_id_table();
+         verify_free_lists();
+      }
     
       struct node : hook<Indices, Allocator>..., value_holder<T> {
          using value_type = T;
@@ -334,7 +1089,15 @@ namespace chainbase {
          typename std::allocator_traits<Allocator>::pointer removed_values_end;
          id_type old_next_id = 0;
          uint64_t ctime = 0; // _monotonic_revision at the point the undo_state was created
+         // Compression left for compress_pending after squash_deferred.  A cursor is the last
+         // element of the session's part of its list that has been examined, or null if the
+         // list has not been started.
+         typename std::allocator_traits<Allocator>::pointer compress_old_cursor = nullptr;
+         typename std::allocator_traits<Allocator>::pointer compress_removed_cursor = nullptr;
+         uint8_t compress_pending = 0; // compress_old_values | compress_removed_values
       };
+      static constexpr uint8_t compress_old_values = 1;
+      static constexpr uint8_t compress_removed_values = 2;
 
       // Exception safety: strong
       template<typename Constructor>
@@ -348,11 +1111,15 @@ namespace chainbase {
          };
          alloc_traits::construct(_allocator, &*p, constructor, propagate_allocator(_allocator));
          auto guard1 = scope_exit{[&]{ alloc_traits::destroy(_allocator, &*p); }};
+         if(_use_id_table) _id_table.push_back(nullptr);
+         auto guard2 = scope_exit{[&]{ if(_use_id_table) _id_table.pop_back(); }};
          if(!insert_impl<1>(p->_item))
             BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, most likely a uniqueness constraint was violated" } );
          std::get<0>(_indices).push_back(p->_item); // cannot fail and we know that it will definitely insert at the end.
          on_create(p->_item);
+         if(_use_id_table) _id_table.back() = p;
          ++_next_id;
+         guard2.cancel();
          guard1.cancel();
          guard0.cancel();
          return p->_item;
@@ -364,6 +1131,7 @@ namespace chainbase {
       template<typename Modifier>
       void modify( const value_type& obj, Modifier&& m) {
          value_type* backup = on_modify(obj);
+         invalidate_lookup_cache(obj);
          value_type& node_ref = const_cast<value_type&>(obj);
          bool success = false;
          {
@@ -371,6 +1139,8 @@ namespace chainbase {
                if(!post_modify<true, 1>(node_ref)) { // The object id cannot be modified
                   if(backup) {
                      node_ref = std::move(*backup);
+                     // The saved value is discarded, so a later modify in this session must save it again.
+                     to_node(node_ref)._mtime = to_old_node(*backup)._mtime;
                      bool success = post_modify<true, 1>(node_ref);
                      (void)success;
                      assert(success);
@@ -429,16 +1199,141 @@ namespace chainbase {
 
       void remove( const value_type& obj ) noexcept {
          auto& node_ref = const_cast<value_type&>(obj);
+         invalidate_lookup_cache(node_ref);
+         if(_use_id_table) _id_table[id_index(obj.id)] = nullptr;
          erase_impl(node_ref);
          if(on_remove(node_ref)) {
             dispose_node(node_ref);
          }
       }
 
+      // Removes every object whose key in index N is in [lo, hi), and returns the number
+      // of objects removed.  The range is split off from index N as one subtree, and the
+      // rest of the index is joined back together, in O(log n).  Each removed object is
+      // then erased from the other indices and saved for undo exactly as by remove.
+      template<int N, typename LowKey, typename HighKey>
+      std::size_t erase_range( const LowKey& lo, const HighKey& hi ) noexcept {
+         auto& idx = std::get<N>(_indices);
+         auto first = idx.lower_bound(lo);
+         if(first == idx.end() || !idx.key_comp()(idx.key_of(*first), hi)) return 0;
+         const std::size_t total = idx.size();
+         std::tuple_element_t<N, indices_type> removed, tail;
+         // The removed objects are counted as they are disposed, which gives the size
+         // of what is left without walking the rest of the index.
+         idx.split_uncounted(first, removed);
+         removed.split_uncounted(removed.lower_bound(hi), tail);
+         idx.join(tail);
+         std::size_t count = 0;
+         // clear_and_dispose unlinks each node before passing it on, so the links of
+         // index 0 are free to be reused by _removed_values even when N is 0.
+         removed.clear_and_dispose([this, &count](pointer p) {
+            ++count;
+            invalidate_lookup_cache(*p);
+            if(_use_id_table) _id_table[id_index(p->id)] = nullptr;
+            erase_other_indices<N>(*p);
+            if(on_remove(*p)) {
+               dispose_node(*p);
+            }
+         });
+         idx.set_size(total - count);
+         return count;
+      }
+
+      template<typename Tag, typename LowKey, typename HighKey>
+      std::size_t erase_range( const LowKey& lo, const HighKey& hi ) noexcept {
+         return erase_range<find_tag<Tag, Indices...>::value>(lo, hi);
+      }
+
+      // Creates count objects, calling c(object, i) to construct the i-th one, e.g. the rows
+      // of a new table.  Their keys in index N must be increasing, and no object already in
+      // index N may have a key between the first and the last of them.  The objects are
+      // linked as a balanced tree that is joined into index N, and into the id index, in
+      // O(log n); the other indices take them one at a time.  This is undone like the
+      // equivalent calls to emplace.
+      //
+      // Exception safety: strong.  Throws std::logic_error if the keys are out of order,
+      // overlap the keys in index N, or violate the uniqueness constraint of another index.
+      template<int N, typename Constructor>
+      void insert_sorted_run( std::size_t count, Constructor&& c ) {
+         if(count == 0) return;
+         auto& idx = std::get<N>(_indices);
+         const uint64_t first_id = id_index(_next_id);
+
+         std::vector<typename alloc_traits::pointer> nodes;
+         nodes.reserve(count);
+         std::size_t constructed = 0;
+         auto guard0 = scope_exit{[&]{
+            for(std::size_t i = 0; i < nodes.size(); ++i) {
+               if(i < constructed) alloc_traits::destroy(_allocator, &*nodes[i]);
+               alloc_traits::deallocate(_allocator, nodes[i], 1);
+            }
+         }};
+         for(std::size_t i = 0; i < count; ++i) {
+            nodes.push_back(alloc_traits::allocate(_allocator, 1));
+         }
+         for(; constructed < count; ++constructed) {
+            auto constructor = [&]( value_type& v ) {
+               v.id = id_type(first_id + constructed);
+               c( v, constructed );
+            };
+            alloc_traits::construct(_allocator, &*nodes[constructed], constructor, propagate_allocator(_allocator));
+         }
+         std::vector<value_type*> values(count);
+         for(std::size_t i = 0; i < count; ++i) {
+            values[i] = &nodes[i]->_item;
+            if(i > 0 && !idx.value_comp()(*values[i - 1], *values[i]))
+               BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert objects, the keys of a sorted run must be increasing" } );
+         }
+         auto next = idx.lower_bound(idx.key_of(*values[0]));
+         if(next != idx.end() && !idx.key_comp()(idx.key_of(*values[count - 1]), idx.key_of(*next)))
+            BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert objects, a sorted run must not overlap the keys in the index" } );
+
+         const std::size_t id_table_size = _id_table.size();
+         if(_use_id_table) _id_table.resize(id_table_size + count);
+         auto guard1 = scope_exit{[&]{ if(_use_id_table) _id_table.resize(id_table_size); }};
+         std::size_t inserted = 0;
+         auto guard2 = scope_exit{[&]{
+            for(std::size_t i = 0; i < inserted; ++i) erase_other_indices<N, 1>(*values[i]);
+         }};
+         for(; inserted < count; ++inserted) {
+            if(!insert_other_indices<N>(*values[inserted]))
+               BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, most likely a uniqueness constraint was violated" } );
+         }
+
+         index0_set_type run0;
+         run0.build_balanced(values.data(), count);
+         std::get<0>(_indices).join(run0);
+         if constexpr (N != 0) {
+            // The run goes between the values before and after next, whose sizes are set at the end
+            const std::size_t total = idx.size();
+            std::tuple_element_t<N, indices_type> run, tail;
+            run.build_balanced(values.data(), count);
+            idx.split_uncounted(next, tail);
+            idx.join(run);
+            idx.join(tail);
+            idx.set_size(total + count);
+         }
+         for(value_type* v : values) {
+            on_create(*v);
+            if(_use_id_table) _id_table[id_index(v->id)] = &to_node(*v);
+         }
+         _next_id = id_type(first_id + count);
+         guard2.cancel();
+         guard1.cancel();
+         guard0.cancel();
+      }
+
+      template<typename Tag, typename Constructor>
+      void insert_sorted_run( std::size_t count, Constructor&& c ) {
+         insert_sorted_run<find_tag<Tag, Indices...>::value>(count, static_cast<Constructor&&>(c));
+      }
+
     private:
 
       void remove( const value_type& obj, removed_nodes_tracker& tracker ) noexcept {
          auto& node_ref = const_cast<value_type&>(obj);
+         invalidate_lookup_cache(node_ref);
+         if(_use_id_table) _id_table[id_index(obj.id)] = nullptr;
          erase_impl(node_ref);
          if(on_remove(node_ref)) {
             tracker.save(node_ref);
@@ -449,6 +1344,9 @@ namespace chainbase {
 
       template<typename CompatibleKey>
       const value_type* find( CompatibleKey&& key) const {
+         if constexpr (is_id_key<CompatibleKey>) {
+            if(_use_id_table) return find_in_id_table(key);
+         }
          const auto& index = std::get<0>(_indices);
          auto iter = index.find(static_cast<CompatibleKey&&>(key));
          if (iter != index.end()) {
@@ -469,6 +1367,176 @@ namespace chainbase {
          return *ptr;
       }
 
+      // Finds an object by the key of the index identified by Tag.  If the lookup
+      // cache is enabled and the index key is hashable, repeated lookups of the
+      // same key are answered from the cache instead of walking the tree.
+      //
+      // Lookups fill the cache, so they write to the undo_index, which must not be mapped
+      // read-only while the cache is enabled.  The entries are atomic, so concurrent readers
+      // can share the cache.
+      template<typename Tag, typename CompatibleKey>
+      const value_type* find( CompatibleKey&& key ) const {
+         constexpr int N = find_tag<Tag, Indices...>::value;
+         if constexpr (N == 0 && is_id_key<CompatibleKey>) {
+            if(_use_id_table) return find_in_id_table(key);
+         }
+         const auto& index = std::get<N>(_indices);
+         using key_type = typename std::tuple_element_t<N, indices_type>::key_type;
+         constexpr bool use_cache = std::is_same_v<std::decay_t<CompatibleKey>, key_type> && is_hashable_key<key_type>;
+         std::size_t slot = 0;
+         if constexpr (use_cache) {
+            if(_lookup_cache_bits) {
+               slot = lookup_cache_slot<N>(key);
+               if(node* p = _lookup_cache[slot].load()) {
+                  const auto& cached_key = index.key_of(p->_item);
+                  if(!index.key_comp()(key, cached_key) && !index.key_comp()(cached_key, key))
+                     return &p->_item;
+               }
+            }
+         }
+         auto iter = index.find(static_cast<CompatibleKey&&>(key));
+         if (iter == index.end()) return nullptr;
+         if constexpr (use_cache) {
+            if(_lookup_cache_bits) _lookup_cache[slot].store(&to_node(*iter));
+         }
+         return &*iter;
+      }
+
+      // Enables a direct-mapped cache from key to object for point lookups made through
+      // find<Tag>.  The number of entries is rounded up to a power of 2.  0 disables the cache.
+      // Only indices whose key type has a std::hash specialization are cached.
+      void set_lookup_cache_size( std::size_t entries ) {
+         lookup_cache_allocator alloc{_allocator};
+         if(_lookup_cache_bits) {
+            lookup_cache_alloc_traits::deallocate(alloc, _lookup_cache, std::size_t(1) << _lookup_cache_bits);
+            _lookup_cache = nullptr;
+            _lookup_cache_bits = 0;
+         }
+         if(entries == 0) return;
+         uint32_t bits = 1;
+         while((std::size_t(1) << bits) < entries) ++bits;
+         _lookup_cache = lookup_cache_alloc_traits::allocate(alloc, std::size_t(1) << bits);
+         for(std::size_t i = 0; i < (std::size_t(1) << bits); ++i) new (&_lookup_cache[i]) lookup_cache_entry;
+         _lookup_cache_bits = bits;
+      }
+
+      std::size_t lookup_cache_size() const {
+         return _lookup_cache_bits ? std::size_t(1) << _lookup_cache_bits : 0;
+      }
+
+      // Maintains a dense table, indexed by id, of pointers to the live objects.  While
+      // enabled, find by id is a single array access instead of a walk of the id index.
+      // The table costs one pointer for every id below the next id, including removed ones.
+      void set_id_table( bool enabled ) {
+         if(enabled == _use_id_table) return;
+         _id_table.clear();
+         _id_table.shrink_to_fit();
+         _use_id_table = false;
+         if(enabled) {
+            _id_table.resize(id_index(_next_id));
+            for(auto& item : std::get<0>(_indices)) {
+               _id_table[id_index(item.id)] = &to_node(item);
+            }
+            _use_id_table = true;
+         }
+      }
+
+      bool has_id_table() const { return _use_id_table; }
+
+      // Fills this undo_index, which must be empty, with the objects of other, an undo_index
+      // of the same value type with different indices.  other is left empty.  This is used
+      // to add an index to a populated table.  The id table is kept if other has one.
+      //
+      // Instead of inserting the objects one at a time, each index is sorted and then
+      // linked as a balanced tree.  Every index is sorted and built on its own thread.
+      //
+      // Exception safety: strong.  Throws std::logic_error if the objects violate the
+      // uniqueness constraint of one of the indices.
+      template<typename... OtherIndices>
+      void build_from( undo_index<T, Allocator, OtherIndices...>& other ) {
+         build_from_impl<true>(other);
+         other.clear_lookup_cache();
+         other.template clear_impl<1>();
+         std::get<0>(other._indices).clear_and_dispose([&](pointer p){ other.dispose_node(*p); });
+         other.rebuild_id_table();
+      }
+
+      // Like build_from, but copies the objects of other, which is not modified.  This is
+      // used where other must stay complete until the new table replaces it.
+      //
+      // Exception safety: strong.
+      template<typename... OtherIndices>
+      void copy_from( const undo_index<T, Allocator, OtherIndices...>& other ) {
+         build_from_impl<false>(other);
+      }
+
+      // Fills this undo_index, which must be empty, with objects converted from the objects
+      // of other, an undo_index with a different value type.  This is used to migrate a
+      // table to a new layout.  For every object of other, convert(old_object, new_object)
+      // is called from the constructor of the new object, after its id has been set to
+      // the id of the old object.  other is not modified.  As with build_from, the id table
+      // is kept if other has one.
+      //
+      // The conversions run on several threads, so convert must be safe to call
+      // concurrently for different objects.  The indices are then built as by build_from.
+      //
+      // Exception safety: strong.
+      template<typename OtherT, typename OtherAllocator, typename... OtherIndices, typename Converter>
+      void convert_from( const undo_index<OtherT, OtherAllocator, OtherIndices...>& other, Converter&& convert ) {
+         using other_type = undo_index<OtherT, OtherAllocator, OtherIndices...>;
+         check_build_from(other);
+
+         std::vector<const OtherT*> sources;
+         sources.reserve(other.size());
+         for(const OtherT& v : other) sources.push_back(&v);
+
+         std::vector<typename alloc_traits::pointer> nodes;
+         std::vector<char> constructed(sources.size());
+         nodes.reserve(sources.size());
+         auto guard = scope_exit{[&]{
+            for(std::size_t i = 0; i < nodes.size(); ++i) {
+               if(constructed[i]) alloc_traits::destroy(_allocator, &*nodes[i]);
+               alloc_traits::deallocate(_allocator, nodes[i], 1);
+            }
+         }};
+         for(std::size_t i = 0; i < sources.size(); ++i) {
+            nodes.push_back(alloc_traits::allocate(_allocator, 1));
+         }
+         for_each_chunk_parallel(sources.size(), [&](std::size_t first, std::size_t last) {
+            auto alloc = propagate_allocator(_allocator);
+            for(std::size_t i = first; i < last; ++i) {
+               const OtherT& source = *sources[i];
+               auto constructor = [&](value_type& v) {
+                  v.id = id_type(other_type::id_index(source.id));
+                  convert(source, v);
+               };
+               alloc_traits::construct(_allocator, &*nodes[i], constructor, alloc);
+               constructed[i] = 1;
+            }
+         });
+
+         std::vector<const value_type*> values(nodes.size());
+         for(std::size_t i = 0; i < nodes.size(); ++i) {
+            values[i] = &nodes[i]->_item;
+            assert(id_index(values[i]->id) == other_type::id_index(sources[i]->id));
+         }
+         auto orders = sort_for_build(values);
+         build_buffers buffers = make_build_buffers(values.size());
+         guard.cancel();
+
+         link_built(nodes, orders, buffers);
+         _next_id = id_type(other_type::id_index(other._next_id));
+         _revision = other._revision;
+         _use_id_table = _use_id_table || other._use_id_table;
+         rebuild_id_table();
+      }
+
+      // Batched find on the primary key.  Writes one pointer (or nullptr) per key, in input order.
+      template<typename KeyIter, typename OutIter>
+      OutIter find_many( KeyIter first, KeyIter last, OutIter out ) const {
+         return std::get<0>(_indices).find_many(first, last, out);
+      }
+
       void remove_object( int64_t id ) {
          const value_type* val = find( typename value_type::id_type(id) );
          if( !val ) BOOST_THROW_EXCEPTION( std::out_of_range( boost::lexical_cast<std::string>(id) ) );
@@ -534,6 +1602,13 @@ namespace chainbase {
          return { _revision - _undo_stack.size(), _revision };
       }
 
+      // The number of states at the bottom of the undo stack that only hold history up to
+      // revision, which commit discards.  revision must not be after _revision.
+      std::size_t undo_states_before( int64_t revision ) const noexcept {
+         const auto kept = static_cast<std::size_t>(_revision - revision);
+         return kept < _undo_stack.size() ? _undo_stack.size() - kept : 0;
+      }
+
       /**
        * Discards all undo history prior to revision
        */
@@ -542,13 +1617,65 @@ namespace chainbase {
          if (revision == _revision) {
             dispose_undo();
             _undo_stack.clear();
-         } else if( (_revision - revision) < _undo_stack.size() ) {
-            auto iter = _undo_stack.begin() + (_undo_stack.size() - (_revision - revision));
+         } else if( std::size_t discarded = undo_states_before(revision) ) {
+            auto iter = _undo_stack.begin() + discarded;
             dispose(get_old_values_end(*iter), get_removed_values_end(*iter));
             _undo_stack.erase(_undo_stack.begin(), iter);
          }
       }
 
+      /**
+       * Discards all undo history prior to revision, like commit, but only detaches the
+       * discarded values instead of freeing them, which takes constant time.  They are
+       * freed by later calls to reclaim, or by the next commit.
+       */
+      void commit_deferred( int64_t revision ) noexcept {
+         revision = std::min(revision, _revision);
+         if (revision == _revision) {
+            // Everything in the lists is discarded.  As with commit, the first element is
+            // left around, because the lists can only be cut after an element.
+            if(!_old_values.empty()) _reclaim_old_after = &*_old_values.begin();
+            if(!_removed_values.empty()) _reclaim_removed_after = &*_removed_values.begin();
+            _undo_stack.clear();
+         } else if( std::size_t discarded = undo_states_before(revision) ) {
+            auto iter = _undo_stack.begin() + discarded;
+            // Everything after the end of the oldest remaining session is discarded.  These
+            // ends are never before the previous ones, so the discarded values only grow.
+            if(iter->old_values_end) _reclaim_old_after = iter->old_values_end;
+            if(iter->removed_values_end) _reclaim_removed_after = iter->removed_values_end;
+            _undo_stack.erase(_undo_stack.begin(), iter);
+         }
+      }
+
+      /**
+       * Frees up to max_nodes of the values discarded by commit_deferred.  Returns the
+       * number of values freed.  This is meant to be called in small slices, e.g. between
+       * blocks, so that freeing a large history does not stall the writer.
+       */
+      std::size_t reclaim( std::size_t max_nodes ) noexcept {
+         std::size_t result = 0;
+         if(_reclaim_old_after) {
+            auto pos = _old_values.iterator_to(*_reclaim_old_after);
+            for(; result < max_nodes && std::next(pos) != _old_values.end(); ++result) {
+               _old_values.erase_after_and_dispose(pos, [this](pointer p){ dispose_old(*p); });
+            }
+            if(std::next(pos) == _old_values.end()) _reclaim_old_after = nullptr;
+         }
+         if(_reclaim_removed_after) {
+            auto pos = _removed_values.iterator_to(*_reclaim_removed_after);
+            for(; result < max_nodes && std::next(pos) != _removed_values.end(); ++result) {
+               _removed_values.erase_after_and_dispose(pos, [this](pointer p){ dispose_node(*p); });
+            }
+            if(std::next(pos) == _removed_values.end()) _reclaim_removed_after = nullptr;
+         }
+         return result;
+      }
+
+      // Whether values discarded by commit_deferred are waiting to be freed by reclaim.
+      bool has_pending_reclaim() const {
+         return _reclaim_old_after || _reclaim_removed_after;
+      }
+
       const undo_index& indices() const { return *this; }
       template<typename Tag>
       const auto& get() const { return std::get<find_tag<Tag, Indices...>::value>(_indices); }
@@ -609,14 +1736,18 @@ namespace chainbase {
       // Resets the contents to the state at the top of the undo stack.
       void undo() noexcept {
          if (_undo_stack.empty()) return;
+         clear_lookup_cache();
          undo_state& undo_info = _undo_stack.back();
          // erase all new_ids
+         // The new ids are a suffix of the id index, which is split off in one piece.
          auto& by_id = std::get<0>(_indices);
-         auto new_ids_iter = by_id.lower_bound(undo_info.old_next_id);
-         by_id.erase_and_dispose(new_ids_iter, by_id.end(), [this](pointer p){
-            erase_impl<1>(*p);
-            dispose_node(*p);
-         });
+         index0_set_type new_objects;
+         by_id.split(by_id.lower_bound(undo_info.old_next_id), new_objects);
+         if(!relink_without_new_objects(new_objects.size(), undo_info.old_next_id)) {
+            for(const value_type& obj : new_objects) erase_impl<1>(const_cast<value_type&>(obj));
+         }
+         new_objects.clear_and_dispose([this](pointer p){ dispose_node(*p); });
+         if(_use_id_table) _id_table.resize(id_index(undo_info.old_next_id));
          // replace old_values
          _old_values.erase_after_and_dispose(_old_values.before_begin(), get_old_values_end(undo_info), [this, &undo_info](pointer p) {
             auto restored_mtime = to_old_node(*p)._mtime;
@@ -642,6 +1773,7 @@ namespace chainbase {
             if (p->id < undo_info.old_next_id) {
                get_removed_field(*p) = 0; // Will be overwritten by tree algorithms, because we're reusing the color.
                insert_impl(*p);
+               if(_use_id_table) _id_table[id_index(p->id)] = &to_node(*p);
             } else {
                dispose_node(*p);
             }
@@ -651,6 +1783,20 @@ namespace chainbase {
          --_revision;
       }
 
+      // Undoes every session after revision, stopping early if the undo stack runs out.
+      // The sessions are first combined without compressing them, which takes constant
+      // time per session.  Every changed object then has exactly one saved value that is
+      // older than the combined session (the _mtime of each saved value tells them apart),
+      // so one pass over the undo lists restores each object once, instead of once for
+      // every session that changed it.
+      void undo_to( int64_t revision ) noexcept {
+         if(revision >= _revision) return;
+         std::size_t count = std::min<std::size_t>(_revision - revision, _undo_stack.size());
+         if(count == 0) return;
+         for(; count > 1; --count) squash_fast();
+         undo();
+      }
+
       // Combines the top two states on the undo stack
       void squash() noexcept {
          squash_and_compress();
@@ -675,10 +1821,294 @@ namespace chainbase {
 
       void compress_last_undo_session() noexcept {
          compress_impl(_undo_stack.back());
+         _undo_stack.back().compress_pending = 0;
+      }
+
+      // Combines the top two states on the undo stack, like squash, in constant time.
+      // The redundant undo values of the combined state are not removed right away,
+      // but by later calls to compress_pending.  Until then the undo stack uses more
+      // memory, but undo still restores the right state.
+      void squash_deferred() noexcept {
+         if(_undo_stack.size() >= 2) {
+            undo_state& merged = _undo_stack[_undo_stack.size() - 2];
+            merged.compress_pending = compress_old_values | compress_removed_values;
+            merged.compress_old_cursor = nullptr;
+            merged.compress_removed_cursor = nullptr;
+         }
+         squash_fast();
+      }
+
+      // Removes redundant undo values left by squash_deferred, examining at most
+      // max_nodes of them.  Returns the number examined.  The most recent states are
+      // compressed first.
+      std::size_t compress_pending( std::size_t max_nodes ) noexcept {
+         std::size_t result = 0;
+         for(std::size_t k = _undo_stack.size(); k-- > 0 && result < max_nodes;) {
+            if(_undo_stack[k].compress_pending) result += compress_step(k, max_nodes - result);
+         }
+         return result;
+      }
+
+      bool has_pending_compression() const {
+         for(const undo_state& session : _undo_stack) {
+            if(session.compress_pending) return true;
+         }
+         return false;
       }
 
     private:
 
+      template<typename, typename, typename...>
+      friend class undo_index;
+
+      [[noreturn]] static void verify_failed(int index, const char* what) {
+         BOOST_THROW_EXCEPTION( std::runtime_error( "index " + std::to_string(index) + ": " + what ) );
+      }
+      [[noreturn]] static void verify_failed(const char* what) {
+         BOOST_THROW_EXCEPTION( std::runtime_error( what ) );
+      }
+
+      void verify_undo_lists() const {
+         const auto& idx0 = std::get<0>(_indices);
+         // The lists grow at the front, so the ends of later sessions come first.
+         auto check_ends = [&](const auto& list, auto get_end, const char* what) {
+            auto iter = list.begin();
+            std::size_t steps = 0;
+            for(auto session = _undo_stack.rbegin(); session != _undo_stack.rend(); ++session) {
+               auto end = get_end(*session);
+               for(; iter != end; ++iter) {
+                  if(iter == list.end() || ++steps > list.size()) verify_failed(what);
+               }
+            }
+         };
+         check_ends(_old_values, [&](const undo_state& s) { return get_old_values_end(s); }, "the undo stack does not match the list of old values");
+         check_ends(_removed_values, [&](const undo_state& s) { return get_removed_values_end(s); }, "the undo stack does not match the list of removed values");
+         for(std::size_t i = 1; i < _undo_stack.size(); ++i) {
+            if(_undo_stack[i].old_next_id < _undo_stack[i - 1].old_next_id || _undo_stack[i].ctime < _undo_stack[i - 1].ctime)
+               verify_failed("the undo stack is not in order");
+         }
+         if(!_undo_stack.empty() && (_next_id < _undo_stack.back().old_next_id || _monotonic_revision < _undo_stack.back().ctime))
+            verify_failed("the undo stack is ahead of the table");
+
+         std::unordered_set<const value_type*> removed;
+         std::size_t steps = 0;
+         for(const value_type& v : _removed_values) {
+            if(++steps > _removed_values.size()) verify_failed("the list of removed values has a cycle");
+            if(get_removed_field(v) != erased_flag) verify_failed("a removed object is not marked as removed");
+            if(!(v.id < _next_id) || idx0.find(v.id) != idx0.end()) verify_failed("a removed object is still in the table");
+            removed.insert(&v);
+         }
+         steps = 0;
+         // Values after the end of the oldest session were committed, and their objects may be gone.
+         auto committed = _undo_stack.empty() ? _old_values.begin() : get_old_values_end(_undo_stack.front());
+         bool in_session = true;
+         bool found_reclaim = !_reclaim_old_after;
+         for(auto iter = _old_values.begin(); iter != _old_values.end(); ++iter) {
+            const value_type& v = *iter;
+            if(++steps > _old_values.size()) verify_failed("the list of old values has a cycle");
+            if(iter == committed) in_session = false;
+            if(_reclaim_old_after && &v == &*_reclaim_old_after) found_reclaim = true;
+            if(!in_session) continue;
+            const value_type& current = to_old_node(const_cast<value_type&>(v))._current->_item;
+            if(!(current.id == v.id)) verify_failed("an old value does not belong to its object");
+            auto current_iter = idx0.find(v.id);
+            if(!(current_iter != idx0.end() && &*current_iter == &current) && !removed.count(&current))
+               verify_failed("an old value belongs to an object that is neither live nor removed");
+         }
+         if(!found_reclaim || (_reclaim_removed_after && !removed.count(&*_reclaim_removed_after)))
+            verify_failed("the values waiting to be reclaimed are not in the undo lists");
+      }
+
+      void verify_id_table() const {
+         if(!_use_id_table) return;
+         if(_id_table.size() != id_index(_next_id)) verify_failed("the id table does not cover every assigned id");
+         std::size_t live = 0;
+         for(const auto& p : _id_table) {
+            if(p) ++live;
+         }
+         if(live != size()) verify_failed("the id table does not hold exactly the live objects");
+         for(const value_type& v : std::get<0>(_indices)) {
+            if(find_in_id_table(v.id) != &v) verify_failed("the id table does not point to an object with its id");
+         }
+      }
+
+      void verify_free_lists() const {
+         if constexpr (has_free_list<decltype(_allocator)> && has_free_list<decltype(_old_values_allocator)>) {
+            std::unordered_set<const void*> free_nodes;
+            bool cycle = false;
+            auto collect = [&](const void* p) { return (cycle = !free_nodes.insert(p).second) == false; };
+            _allocator.for_each_free(collect);
+            if(!cycle) _old_values_allocator.for_each_free(collect);
+            if(cycle) verify_failed("a free list has a cycle");
+            auto check = [&](const void* p) {
+               if(free_nodes.count(p)) verify_failed("a node in use is on a free list");
+            };
+            for(const value_type& v : std::get<0>(_indices)) check(&to_node(v));
+            for(const value_type& v : _removed_values) check(&to_node(v));
+            for(const value_type& v : _old_values) check(&to_old_node(const_cast<value_type&>(v)));
+         }
+      }
+
+      // Fills this undo_index from other, moving the objects out of other if Move.  The moved
+      // objects are left in other for the caller to free.
+      template<bool Move, typename Other>
+      void build_from_impl(const Other& other) {
+         check_build_from(other);
+
+         std::vector<const value_type*> values;
+         values.reserve(other.size());
+         for(const value_type& v : other) values.push_back(&v);
+         auto orders = sort_for_build(values);
+
+         // Allocate every node before moving anything out of other.
+         std::vector<typename alloc_traits::pointer> nodes;
+         nodes.reserve(values.size());
+         std::size_t constructed = 0;
+         auto guard = scope_exit{[&]{
+            for(std::size_t i = 0; i < nodes.size(); ++i) {
+               if(i < constructed) alloc_traits::destroy(_allocator, &*nodes[i]);
+               alloc_traits::deallocate(_allocator, nodes[i], 1);
+            }
+         }};
+         for(std::size_t i = 0; i < values.size(); ++i) {
+            nodes.push_back(alloc_traits::allocate(_allocator, 1));
+         }
+         build_buffers buffers = make_build_buffers(values.size());
+         for(; constructed < values.size(); ++constructed) {
+            if constexpr (Move) alloc_traits::construct(_allocator, &*nodes[constructed], std::move_if_noexcept(const_cast<value_type&>(*values[constructed])));
+            else alloc_traits::construct(_allocator, &*nodes[constructed], *values[constructed]);
+         }
+         guard.cancel();
+
+         link_built(nodes, orders, buffers);
+         _next_id = other._next_id;
+         _revision = other._revision;
+         _use_id_table = _use_id_table || other._use_id_table;
+         rebuild_id_table();
+      }
+
+      template<typename Other>
+      void check_build_from(const Other& other) const {
+         if( !empty() || _next_id != 0 || has_undo_session() )
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot build into an undo_index that is not empty") );
+         if( other.has_undo_session() )
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot build from an undo_index that has an undo stack") );
+      }
+
+      using build_orders = std::array<std::vector<std::size_t>, sizeof...(Indices)>;
+      using build_buffers = std::array<std::vector<value_type*>, sizeof...(Indices)>;
+
+      // Returns the position in values of each object in the order of each index.
+      // values must be in id order, which is the order of index 0, so the order of
+      // index 0 is left empty.  Throws if a uniqueness constraint is violated.
+      build_orders sort_for_build(const std::vector<const value_type*>& values) const {
+         build_orders orders;
+         for_each_index_parallel([&](auto n) {
+            constexpr int N = decltype(n)::value;
+            if constexpr (N != 0) {
+               auto& order = orders[N];
+               order.resize(values.size());
+               for(std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+               auto comp = std::get<N>(_indices).value_comp();
+               std::sort(order.begin(), order.end(), [&](std::size_t lhs, std::size_t rhs) { return comp(*values[lhs], *values[rhs]); });
+               for(std::size_t i = 1; i < order.size(); ++i) {
+                  if(!comp(*values[order[i - 1]], *values[order[i]]))
+                     BOOST_THROW_EXCEPTION( std::logic_error{ "could not build index, a uniqueness constraint was violated" } );
+               }
+            }
+         });
+         return orders;
+      }
+
+      // Links the constructed nodes into every index.  buffers must hold one
+      // element per node for every index, so that this cannot fail.
+      void link_built(const std::vector<typename alloc_traits::pointer>& nodes, const build_orders& orders, build_buffers& buffers) noexcept {
+         for_each_index_parallel([&](auto n) {
+            constexpr int N = decltype(n)::value;
+            auto& items = buffers[N];
+            for(std::size_t i = 0; i < items.size(); ++i) {
+               items[i] = &nodes[N == 0 ? i : orders[N][i]]->_item;
+            }
+            std::get<N>(_indices).build_balanced(items.data(), items.size());
+         });
+      }
+
+      static build_buffers make_build_buffers(std::size_t size) {
+         build_buffers result;
+         for(auto& items : result) items.resize(size);
+         return result;
+      }
+
+      void rebuild_id_table() {
+         if(_use_id_table) {
+            _use_id_table = false;
+            set_id_table(true);
+         }
+      }
+
+      // Calls f(first, last) for consecutive chunks of [0, count) on several threads,
+      // and rethrows the first exception thrown by f.
+      template<typename F>
+      static void for_each_chunk_parallel(std::size_t count, F&& f) {
+         constexpr std::size_t min_chunk = 1024;
+         std::size_t num_chunks = std::max<std::size_t>(1, std::min<std::size_t>(std::thread::hardware_concurrency(), count / min_chunk));
+         std::size_t chunk = (count + num_chunks - 1) / std::max<std::size_t>(num_chunks, 1);
+         std::vector<std::exception_ptr> errors(num_chunks);
+         std::vector<std::thread> threads;
+         auto run = [&](std::size_t i) {
+            try {
+               f(std::min(count, i * chunk), std::min(count, (i + 1) * chunk));
+            } catch(...) {
+               errors[i] = std::current_exception();
+            }
+         };
+         for(std::size_t i = 0; i < num_chunks; ++i) {
+            bool started = false;
+            try {
+               threads.emplace_back(run, i);
+               started = true;
+            } catch(...) {}
+            if(!started) run(i);
+         }
+         for(auto& t : threads) t.join();
+         for(auto& e : errors) {
+            if(e) std::rethrow_exception(e);
+         }
+      }
+
+      // Calls f(std::integral_constant<int, N>{}) for every index N, each on its own
+      // thread, and rethrows the first exception thrown by f.  Falls back to the
+      // calling thread if a thread cannot be started.
+      template<typename F>
+      static void for_each_index_parallel(F&& f) {
+         for_each_index_parallel(f, std::make_index_sequence<sizeof...(Indices)>{});
+      }
+      template<typename F, std::size_t... N>
+      static void for_each_index_parallel(F& f, std::index_sequence<N...>) {
+         std::exception_ptr errors[sizeof...(N)];
+         auto run = [&](auto n) {
+            try {
+               f(n);
+            } catch(...) {
+               errors[decltype(n)::value] = std::current_exception();
+            }
+         };
+         std::vector<std::thread> threads;
+         auto start = [&](auto n) {
+            bool started = false;
+            try {
+               threads.emplace_back([&run, n]{ run(n); });
+               started = true;
+            } catch(...) {}
+            if(!started) run(n);
+         };
+         (start(std::integral_constant<int, N>{}), ...);
+         for(auto& t : threads) t.join();
+         for(auto& e : errors) {
+            if(e) std::rethrow_exception(e);
+         }
+      }
+
       // Removes elements of the last undo session that would be redundant
       // if all the sessions after @c session were squashed.
       //
@@ -690,14 +2120,7 @@ namespace chainbase {
          auto old_next_id = session.old_next_id;
          remove_if_after_and_dispose(_old_values, _old_values.before_begin(), get_old_values_end(_undo_stack.back()),
                                      [session_start](value_type& v){
-                                        if(to_old_node(v)._mtime >= session_start) return true;
-                                        auto& item = to_old_node(v)._current->_item;
-                                        if (get_removed_field(item) == erased_flag) {
-                                           item = std::move(v);
-                                           to_node(item)._mtime = to_old_node(v)._mtime;
-                                           return true;
-                                        }
-                                        return false;
+                                        return is_redundant_old_value(v, session_start, true);
                                      },
                                      [&](pointer p) { dispose_old(*p); });
          remove_if_after_and_dispose(_removed_values, _removed_values.before_begin(), get_removed_values_end(_undo_stack.back()),
@@ -707,6 +2130,60 @@ namespace chainbase {
                                      [this](pointer p) { dispose_node(*p); });
       }
 
+      // Returns true if the old value v can be dropped from a session that started at
+      // session_start.  If the object was removed, its removed node can take over v, but
+      // only if the removal is in the same session, which is known when it is the last one.
+      static bool is_redundant_old_value(value_type& v, uint64_t session_start, bool last_session) noexcept {
+         if(to_old_node(v)._mtime >= session_start) return true;
+         if(!last_session) return false;
+         auto& item = to_old_node(v)._current->_item;
+         if (get_removed_field(item) == erased_flag) {
+            item = std::move(v);
+            to_node(item)._mtime = to_old_node(v)._mtime;
+            return true;
+         }
+         return false;
+      }
+
+      // Applies the optimizations of compress_impl to the part of the undo lists that
+      // belongs to _undo_stack[k], examining at most max_nodes elements, and returns the
+      // number examined.  The first element of each part is kept, because the next state
+      // refers to it, and it is where the cursor starts.
+      std::size_t compress_step(std::size_t k, std::size_t max_nodes) noexcept {
+         undo_state& session = _undo_stack[k];
+         const bool last_session = k + 1 == _undo_stack.size();
+         std::size_t result = 0;
+         auto step = [&](auto& list, auto& cursor_ptr, auto part_begin, auto part_end, uint8_t flag, auto&& redundant, auto&& disposer) {
+            if(!(session.compress_pending & flag)) return;
+            if(!cursor_ptr) {
+               if(part_begin == part_end) { session.compress_pending &= ~flag; return; }
+               cursor_ptr = &*part_begin;
+            }
+            auto cursor = list.iterator_to(*cursor_ptr);
+            for(; result < max_nodes; ++result) {
+               auto next = std::next(cursor);
+               if(next == part_end) {
+                  session.compress_pending &= ~flag;
+                  break;
+               }
+               if(redundant(*next)) list.erase_after_and_dispose(cursor, disposer);
+               else cursor = next;
+            }
+            cursor_ptr = &*cursor;
+         };
+         step(_old_values, session.compress_old_cursor,
+              last_session ? _old_values.begin() : get_old_values_end(_undo_stack[k + 1]), get_old_values_end(session),
+              compress_old_values,
+              [&](value_type& v) { return is_redundant_old_value(v, session.ctime, last_session); },
+              [this](pointer p) { dispose_old(*p); });
+         step(_removed_values, session.compress_removed_cursor,
+              last_session ? _removed_values.begin() : get_removed_values_end(_undo_stack[k + 1]), get_removed_values_end(session),
+              compress_removed_values,
+              [&](value_type& v) { return v.id >= session.old_next_id; },
+              [this](pointer p) { dispose_node(*p); });
+         return result;
+      }
+
       // starts a new undo session.
       // Exception safety: strong
       int64_t add_session() {
@@ -736,6 +2213,10 @@ namespace chainbase {
       // Moves a modified node into the correct location
       template<bool unique, int N = 0>
       bool post_modify(value_type& p) {
+         if constexpr (N == 1) {
+            // The id cannot change, so the object never moves in index 0, but its aggregate might.
+            std::get<0>(_indices).update_aggregate(p);
+         }
          if constexpr (N < sizeof...(Indices)) {
             auto& idx = std::get<N>(_indices);
             auto iter = idx.iterator_to(p);
@@ -749,7 +2230,9 @@ namespace chainbase {
             if (iter != idx.end()) {
                if(!idx.value_comp()(p, *iter)) fixup = true;
             }
-            if(fixup) {
+            if(!fixup) {
+               idx.update_aggregate(p);
+            } else {
                auto iter2 = idx.iterator_to(p);
                idx.erase(iter2);
                if constexpr (unique) {
@@ -776,6 +2259,38 @@ namespace chainbase {
          }
       }
 
+      // Inserts p into every index except the id index and Skip
+      template<int Skip, int N = 1>
+      bool insert_other_indices(value_type& p) {
+         if constexpr (N < sizeof...(Indices)) {
+            if constexpr (N == Skip) {
+               return insert_other_indices<Skip, N+1>(p);
+            } else {
+               auto [iter, inserted] = std::get<N>(_indices).insert_unique(p);
+               if(!inserted) return false;
+               auto guard = scope_exit{[this,iter=iter]{ std::get<N>(_indices).erase(iter); }};
+               if(insert_other_indices<Skip, N+1>(p)) {
+                  guard.cancel();
+                  return true;
+               }
+               return false;
+            }
+         }
+         return true;
+      }
+
+      // Erases p from every index except Skip
+      template<int Skip, int N = 0>
+      void erase_other_indices(value_type& p) {
+         if constexpr (N < sizeof...(Indices)) {
+            if constexpr (N != Skip) {
+               auto& setN = std::get<N>(_indices);
+               setN.erase(setN.iterator_to(p));
+            }
+            erase_other_indices<Skip, N+1>(p);
+         }
+      }
+
       void on_create(const value_type& value) noexcept {
          if(!_undo_stack.empty()) {
             // Not in old_values, removed_values, or new_ids
@@ -803,6 +2318,89 @@ namespace chainbase {
          }
          return nullptr;
       }
+      template<typename K>
+      static constexpr bool is_hashable_key = std::is_default_constructible_v<std::hash<K>>;
+
+      template<typename K>
+      static constexpr bool is_id_key = std::is_same_v<std::decay_t<K>, id_type> || std::is_integral_v<std::decay_t<K>>;
+
+      static uint64_t id_index(const id_type& id) {
+         if constexpr (std::is_integral_v<id_type>) return static_cast<uint64_t>(id);
+         else return static_cast<uint64_t>(id._id);
+      }
+
+      template<typename K>
+      const value_type* find_in_id_table(const K& key) const {
+         auto i = id_index(id_type(key));
+         if(i >= _id_table.size()) return nullptr;
+         const auto& p = _id_table[i];
+         return p ? &p->_item : nullptr;
+      }
+
+      template<int N, typename K>
+      std::size_t lookup_cache_slot(const K& key) const {
+         uint64_t h = std::hash<K>{}(key);
+         h = (h + N) * 0x9E3779B97F4A7C15ull; // Fibonacci hashing spreads sequential keys
+         return h >> (64 - _lookup_cache_bits);
+      }
+
+      void clear_lookup_cache() noexcept {
+         for(std::size_t i = 0; i < lookup_cache_size(); ++i) _lookup_cache[i].store(nullptr);
+      }
+
+      // Every cache entry that points to a node is in the slot of one of the node's
+      // current keys, so clearing those slots removes all references to the node.
+      // This must run before a node is removed or its keys are changed.
+      template<int N = 0>
+      void invalidate_lookup_cache(const value_type& obj) noexcept {
+         if constexpr (N < sizeof...(Indices)) {
+            if(!_lookup_cache_bits) return;
+            const auto& index = std::get<N>(_indices);
+            using key_type = typename std::tuple_element_t<N, indices_type>::key_type;
+            if constexpr (is_hashable_key<key_type>) {
+               auto& entry = _lookup_cache[lookup_cache_slot<N>(index.key_of(obj))];
+               if(entry.load() == &to_node(obj)) entry.store(nullptr);
+            }
+            invalidate_lookup_cache<N+1>(obj);
+         }
+      }
+
+      // Fast path for undoing a session that mostly created objects, after the new objects
+      // have been split off from the id index.  When they are at least as many as the
+      // objects that remain, every other index is relinked as a balanced tree of the
+      // remaining objects instead of erasing the new objects one at a time, which visits
+      // every node once and never rebalances.  Returns false, without changing anything,
+      // if the fast path does not apply or its buffer cannot be allocated.
+      bool relink_without_new_objects(std::size_t num_new, id_type old_next_id) noexcept {
+         // Below this, the per-node erase is cheap enough that the buffer is not worth it.
+         constexpr std::size_t min_new_objects = 256;
+         const std::size_t num_kept = size();
+         if(sizeof...(Indices) == 1 || num_new < min_new_objects || num_new < num_kept) return false;
+         std::vector<value_type*> items;
+         try {
+            items.resize(num_kept);
+         } catch(std::bad_alloc&) {
+            return false;
+         }
+         relink_kept<1>(items.data(), num_kept, old_next_id);
+         return true;
+      }
+
+      template<int N>
+      void relink_kept(value_type** items, std::size_t num_kept, id_type old_next_id) noexcept {
+         if constexpr (N < sizeof...(Indices)) {
+            auto& idx = std::get<N>(_indices);
+            std::size_t pos = 0;
+            for(auto iter = idx.begin(); iter != idx.end(); ++iter) {
+               if(iter->id < old_next_id) items[pos++] = const_cast<value_type*>(&*iter);
+            }
+            assert(pos == num_kept);
+            idx.clear();
+            idx.build_balanced(items, num_kept);
+            relink_kept<N+1>(items, num_kept, old_next_id);
+         }
+      }
+
       template<int N = 0>
       void clear_impl() noexcept {
          if constexpr(N < sizeof...(Indices)) {
@@ -828,14 +2426,21 @@ namespace chainbase {
       }
       void dispose(typename list_base<old_node, index0_type>::iterator old_start, typename list_base<node, index0_type>::iterator removed_start) noexcept {
          // This will leave one element around.  That's okay, because we'll clean it up the next time.
-         if(old_start != _old_values.end())
+         // Anything left by commit_deferred is after the start, so it is freed as well.
+         if(old_start != _old_values.end()) {
             _old_values.erase_after_and_dispose(old_start, _old_values.end(), [this](pointer p){ dispose_old(*p); });
-         if(removed_start != _removed_values.end())
+            _reclaim_old_after = nullptr;
+         }
+         if(removed_start != _removed_values.end()) {
             _removed_values.erase_after_and_dispose(removed_start, _removed_values.end(), [this](pointer p){ dispose_node(*p); });
+            _reclaim_removed_after = nullptr;
+         }
       }
       void dispose_undo() noexcept {
          _old_values.clear_and_dispose([this](pointer p){ dispose_old(*p); });
          _removed_values.clear_and_dispose([this](pointer p){ dispose_node(*p); });
+         _reclaim_old_after = nullptr;
+         _reclaim_removed_after = nullptr;
       }
       static node& to_node(value_type& obj) {
          return static_cast<node&>(*boost::intrusive::get_parent_from_member(&obj, &value_holder<value_type>::_item));
@@ -890,6 +2495,25 @@ namespace chainbase {
          return static_cast<hook<index0_type, Allocator>&>(to_node(obj))._color;
       }
       using old_alloc_traits = typename std::allocator_traits<Allocator>::template rebind_traits<old_node>;
+      using cache_allocator = rebind_alloc_t<Allocator, typename alloc_traits::pointer>;
+      // An entry of the lookup cache links to its node by offset, like the tree links, so
+      // that the cache works wherever the segment is mapped.  Lookups under a shared lock
+      // fill the cache concurrently, so the entries are atomic.  They can be relaxed,
+      // because the nodes themselves are published by the lock.  An entry is never its
+      // own node, so 0 means empty.
+      struct lookup_cache_entry {
+         std::atomic<std::ptrdiff_t> _offset{0};
+         node* load() const noexcept {
+            const std::ptrdiff_t offset = _offset.load(std::memory_order_relaxed);
+            return offset ? (node*)((std::uintptr_t)this + offset) : nullptr;
+         }
+         void store(const node* p) noexcept {
+            _offset.store(p ? (const char*)p - (const char*)this : 0, std::memory_order_relaxed);
+         }
+      };
+      static_assert(std::atomic<std::ptrdiff_t>::is_always_lock_free, "the lookup cache must be usable from several processes");
+      using lookup_cache_allocator = rebind_alloc_t<Allocator, lookup_cache_entry>;
+      using lookup_cache_alloc_traits = std::allocator_traits<lookup_cache_allocator>;
       indices_type _indices;
       boost::container::deque<undo_state, rebind_alloc_t<Allocator, undo_state>> _undo_stack;
       list_base<old_node, index0_type> _old_values;
@@ -899,6 +2523,13 @@ namespace chainbase {
       id_type _next_id = 0;
       int64_t _revision = 0;
       uint64_t _monotonic_revision = 0;
+      typename lookup_cache_alloc_traits::pointer _lookup_cache = nullptr;
+      uint32_t _lookup_cache_bits = 0;
+      bool _use_id_table = false;
+      boost::container::deque<typename alloc_traits::pointer, cache_allocator> _id_table;
+      // The values after these, if any, were discarded by commit_deferred and not freed yet.
+      typename std::allocator_traits<Allocator>::pointer _reclaim_old_after = nullptr;
+      typename std::allocator_traits<Allocator>::pointer _reclaim_removed_after = nullptr;
       uint32_t                        _size_of_value_type = sizeof(node);
       uint32_t                        _size_of_this = sizeof(undo_index);
    };
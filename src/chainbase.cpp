@@ -1,7 +1,9 @@
 #include <chainbase/chainbase.hpp>
 #include <boost/array.hpp>
 
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 #ifndef _WIN32
 #include <sys/mman.h>
@@ -11,17 +13,42 @@ namespace chainbase {
 
    database::database(const bfs::path& dir, open_flags flags, uint64_t shared_file_size, bool allow_dirty,
                       pinnable_mapped_file::map_mode db_map_mode, std::vector<std::string> hugepage_paths ) :
-      _db_file(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths),
-      _read_only(flags == database::read_only)
+      _db_file(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths, "shared_memory", flags == database::immutable),
+      _read_only(!(flags & database::read_write)),
+      _immutable(flags == database::immutable),
+      _dir(dir),
+      _allow_dirty(allow_dirty)
    {
    }
 
+   void database::add_segment( const std::string& name, uint64_t size, pinnable_mapped_file::map_mode mode,
+                               std::vector<std::string> hugepage_paths )
+   {
+      if( name.empty() || name == "shared_memory" || bfs::path( name ).filename() != name ) {
+         BOOST_THROW_EXCEPTION( std::logic_error( "\"" + name + "\" cannot be the name of a segment" ) );
+      }
+      if( _segments.count( name ) ) {
+         BOOST_THROW_EXCEPTION( std::logic_error( "segment " + name + " has already been added" ) );
+      }
+      if( _db_file.is_speculating() ) {
+         BOOST_THROW_EXCEPTION( std::logic_error( "cannot add segment " + name + " while speculating" ) );
+      }
+      _segments.try_emplace( name, _dir, !_read_only, size, _allow_dirty, mode, std::move( hugepage_paths ), name, _immutable );
+   }
+
    database::~database()
    {
       _index_list.clear();
       _index_map.clear();
    }
 
+   void database::wait_for_load()
+   {
+      _db_file.wait_for_load();
+      for( auto& [name, segment] : _segments )
+         segment.wait_for_load();
+   }
+
    void database::set_require_locking( bool enable_require_locking )
    {
 #ifdef CHAINBASE_CHECK_LOCKING
@@ -46,6 +73,58 @@ namespace chainbase {
       }
    }
 
+   void database::undo_to( int64_t revision )
+   {
+      for( auto& item : _index_list )
+      {
+         item->undo_to( revision );
+      }
+   }
+
+   void database::start_speculation()
+   {
+      _db_file.start_speculation();
+      try {
+         for( auto& [name, segment] : _segments )
+            segment.start_speculation();
+      } catch( ... ) {
+         for( auto& [name, segment] : _segments )
+            segment.discard_speculation();
+         _db_file.discard_speculation();
+         throw;
+      }
+      _speculation_index_count = _index_list.size();
+      _speculation = std::make_shared<char>();
+   }
+
+   void database::commit_speculation()
+   {
+      _db_file.commit_speculation();
+      for( auto& [name, segment] : _segments )
+         segment.commit_speculation();
+      // Sessions started while speculating stay valid, their undo states are in the file now
+      _speculation.reset();
+   }
+
+   void database::discard_speculation()
+   {
+      if( !_db_file.is_speculating() ) return;
+      if( _speculation.use_count() > 1 ) {
+         BOOST_THROW_EXCEPTION( std::logic_error( "cannot discard speculation while undo sessions started during it are open" ) );
+      }
+      _db_file.discard_speculation();
+      for( auto& [name, segment] : _segments )
+         segment.discard_speculation();
+      _speculation.reset();
+      // Indices added while speculating only exist in the copied pages
+      while( _index_list.size() > _speculation_index_count )
+      {
+         auto type_id = _index_list.back()->type_id();
+         _index_list.pop_back();
+         _index_map[type_id].reset();
+      }
+   }
+
    void database::squash()
    {
       for( auto& item : _index_list )
@@ -54,6 +133,26 @@ namespace chainbase {
       }
    }
 
+   void database::squash_deferred()
+   {
+      for( auto& item : _index_list )
+      {
+         item->squash_deferred();
+      }
+   }
+
+   bool database::compress_pending( std::size_t max_nodes )
+   {
+      bool pending = false;
+      for( auto& item : _index_list )
+      {
+         if( max_nodes )
+            max_nodes -= item->compress_pending( max_nodes );
+         pending = pending || item->has_pending_compression();
+      }
+      return pending;
+   }
+
    void database::commit( int64_t revision )
    {
       for( auto& item : _index_list )
@@ -62,6 +161,26 @@ namespace chainbase {
       }
    }
 
+   void database::commit_deferred( int64_t revision )
+   {
+      for( auto& item : _index_list )
+      {
+         item->commit_deferred( revision );
+      }
+   }
+
+   bool database::reclaim( std::size_t max_nodes )
+   {
+      bool pending = false;
+      for( auto& item : _index_list )
+      {
+         if( max_nodes )
+            max_nodes -= item->reclaim( max_nodes );
+         pending = pending || item->has_pending_reclaim();
+      }
+      return pending;
+   }
+
    void database::undo_all()
    {
       for( auto& item : _index_list )
@@ -70,6 +189,73 @@ namespace chainbase {
       }
    }
 
+   std::optional<std::string> database::find_in_other_segment( pinnable_mapped_file::segment_manager* segment, const std::string& type_name )const
+   {
+      if( segment != _db_file.get_segment_manager() && _db_file.get_segment_manager()->find_no_lock< char >( type_name.c_str() ).first )
+         return std::string( "the database file" );
+      for( const auto& [name, other] : _segments ) {
+         if( other.get_segment_manager() != segment && other.get_segment_manager()->find_no_lock< char >( type_name.c_str() ).first )
+            return "segment " + name;
+      }
+      return std::nullopt;
+   }
+
+   std::vector<index_access> database::index_access_counts()const
+   {
+      std::vector<index_access> result;
+      result.reserve( _index_list.size() );
+      for( const auto* item : _index_list ) {
+         result.push_back( index_access{ item->type_name(), item->segment(), item->reads(), item->writes(),
+                                         item->row_count() * item->node_size() } );
+      }
+      return result;
+   }
+
+   std::map<std::string, std::string> database::tiered_index_placement( const std::vector<index_access>& accesses, uint64_t hot_bytes,
+                                                                        const std::string& hot_segment, const std::string& cold_segment )
+   {
+      std::vector<const index_access*> by_density;
+      for( const auto& access : accesses ) by_density.push_back( &access );
+      auto density = []( const index_access* a ) { return double( a->reads + a->writes ) / std::max<uint64_t>( a->size, 1 ); };
+      std::stable_sort( by_density.begin(), by_density.end(), [&]( const index_access* a, const index_access* b ) {
+         return density( a ) > density( b );
+      } );
+      std::map<std::string, std::string> placement;
+      uint64_t hot_size = 0;
+      for( const auto* access : by_density ) {
+         bool hot = access->reads + access->writes > 0 && hot_size + access->size <= hot_bytes;
+         if( hot ) hot_size += access->size;
+         placement[access->type_name] = hot ? hot_segment : cold_segment;
+      }
+      return placement;
+   }
+
+   std::vector<std::string> database::check_integrity()const
+   {
+      std::vector<std::string> errors( _index_list.size() );
+      auto check = [&]( std::size_t i ) {
+         try {
+            _index_list[i]->verify();
+         } catch( const std::exception& e ) {
+            errors[i] = _index_list[i]->type_name() + ": " + e.what();
+         } catch( ... ) {
+            errors[i] = _index_list[i]->type_name() + ": unknown error";
+         }
+      };
+      std::vector<std::thread> threads;
+      for( std::size_t i = 0; i < _index_list.size(); ++i ) {
+         try {
+            threads.emplace_back( check, i );
+         } catch( const std::system_error& ) {
+            check( i );
+         }
+      }
+      for( auto& t : threads ) t.join();
+
+      errors.erase( std::remove( errors.begin(), errors.end(), std::string() ), errors.end() );
+      return errors;
+   }
+
    database::session database::start_undo_session( bool enabled )
    {
       if( enabled ) {
@@ -78,7 +264,7 @@ namespace chainbase {
          for( auto& item : _index_list ) {
             _sub_sessions.push_back( item->start_undo_session( enabled ) );
          }
-         return session( std::move( _sub_sessions ) );
+         return session( std::move( _sub_sessions ), _speculation );
       } else {
          return session();
       }
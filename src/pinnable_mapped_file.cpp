@@ -3,11 +3,34 @@
 #include <boost/interprocess/managed_external_buffer.hpp>
 #include <boost/interprocess/anonymous_shared_memory.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
 #include <iostream>
+#include <thread>
 
 #ifdef __linux__
 #include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #include <linux/magic.h>
+#include <linux/userfaultfd.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CHAINBASE_CRC32C_SSE42
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CHAINBASE_CRC32C_ARM
 #endif
 
 namespace chainbase {
@@ -23,11 +46,11 @@ std::string chainbase_error_category::message(int ev) const {
       case db_error_code::dirty:
 	 return "Database dirty flag set";
       case db_error_code::incompatible:
-	 return "Database incompatible; All environment parameters must match";
+	 return "Database incompatible; environment parameters do not match";
       case db_error_code::incorrect_db_version:
 	 return "Database format not compatible with this version of chainbase";
       case db_error_code::locked_mode_required:
-	 return "Locked mode is required for hugepage usage";
+	 return "Heap or locked mode is required for hugepage usage";
       case db_error_code::not_found:
 	 return "Database file not found";
       case db_error_code::bad_size:
@@ -44,6 +67,10 @@ std::string chainbase_error_category::message(int ev) const {
 	 return "Database load aborted";
       case db_error_code::no_mlock:
 	 return "Failed to mlock database";
+      case db_error_code::bad_checksum:
+	 return "Database file does not match its checksums";
+      case db_error_code::no_speculation:
+	 return "Speculation requires a writable database in mapped mode";
       default:
          return "Unrecognized error code";
    }
@@ -54,11 +81,281 @@ const std::error_category& chainbase_error_category() {
    return the_category;
 }
 
+//In lazy mode the database is loaded into an anonymous region that is registered with userfaultfd, so the
+//first access to each page that has not been loaded yet stops until the loader thread copies it from the
+//file.  In between, the loader copies the rest of the file in order, so that every page is eventually loaded.
+//
+//Each chunk is checked against its checksum before any of its pages are copied.  The first chunk, which holds
+//the segment manager, is checked before the database is opened.  A later chunk that does not match, or whose
+//pages cannot be copied, is filled with zeros instead, because whoever accesses it cannot be told; the error
+//is reported right away and thrown by wait().
+class pinnable_mapped_file::lazy_loader {
+   public:
+      //takes source over and returns the loader, or nullptr if userfaultfd is not available; hot chunks are loaded first
+      static std::unique_ptr<lazy_loader> start(bip::mapped_region& source, const bfs::path& checksum_file_path, const std::string& database_name,
+                                                std::vector<bool> hot);
+      ~lazy_loader();
+
+      bip::mapped_region take_region() { return std::move(_region); }
+      void wait();
+
+      //once loaded, the chunks to load first next time
+      std::vector<bool> observed_hot_chunks() const;
+
+   private:
+      lazy_loader(bip::mapped_region&& source, bip::mapped_region&& region, int fd, std::vector<uint64_t> checksums, const std::string& database_name,
+                  std::vector<bool> hot);
+      void run();
+      bool serve_faults();
+      void copy(size_t begin, size_t end);
+      void zero(size_t begin, size_t end);
+      bool verify(size_t chunk);
+      void fail(std::exception_ptr error);
+
+      constexpr static size_t fault_block = 64*1024;
+
+      bip::mapped_region _source;
+      bip::mapped_region _region;
+      const char*        _src;
+      char*              _dst;
+      size_t             _size;
+      int                _fd;
+      std::vector<uint64_t> _checksums; //empty without a checksum file
+      std::string        _database_name;
+      std::vector<bool>  _hot;
+      std::vector<bool>  _loaded;   //chunks loaded in order
+      std::vector<bool>  _faulted;  //chunks accessed before they were loaded in order
+      std::vector<bool>  _verified; //chunks that matched their checksums
+      std::vector<bool>  _bad;      //chunks filled with zeros instead
+      bool               _complete = false;
+      std::atomic<bool>  _stop{false};
+      std::exception_ptr _error;
+      std::thread        _thread;
+};
+
+std::unique_ptr<pinnable_mapped_file::lazy_loader> pinnable_mapped_file::lazy_loader::start(bip::mapped_region& source, const bfs::path& checksum_file_path,
+                                                                                           const std::string& database_name, std::vector<bool> hot) {
+#ifdef __linux__
+   std::vector<uint64_t> checksums;
+   if(bfs::exists(checksum_file_path)) {
+      checksums = read_checksums(checksum_file_path, database_name, source.get_size());
+      if(!chunk_matches(checksums, (const char*)source.get_address(), 0)) {
+         std::string what_str("\"" + database_name + "\" database file does not match its checksum at offset 0");
+         BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_checksum), what_str));
+      }
+   }
+   bip::mapped_region region(bip::anonymous_shared_memory(source.get_size()));
+   //a userfaultfd restricted to user mode faults would make system calls that access pages not loaded yet,
+   //such as write(2) from a string in the database, fail with EFAULT instead of waiting, so it is not used
+   int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+   if(fd >= 0) {
+      uffdio_api api = {};
+      api.api = UFFD_API;
+      uffdio_register reg = {};
+      reg.range.start = (uintptr_t)region.get_address();
+      reg.range.len = region.get_size();
+      reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+      if(ioctl(fd, UFFDIO_API, &api) == 0 && ioctl(fd, UFFDIO_REGISTER, &reg) == 0 &&
+         (reg.ioctls & (1ULL << _UFFDIO_COPY)) && (reg.ioctls & (1ULL << _UFFDIO_ZEROPAGE))) {
+         std::cerr << "CHAINBASE: Loading \"" << database_name << "\" database file in the background" << std::endl;
+         return std::unique_ptr<lazy_loader>(new lazy_loader(std::move(source), std::move(region), fd, std::move(checksums), database_name, std::move(hot)));
+      }
+      const int error = errno;
+      close(fd);
+      errno = error;
+   }
+   std::cerr << "CHAINBASE: \"" << database_name << "\" cannot be loaded lazily without userfaultfd: " << strerror(errno) << std::endl;
+#else
+   std::cerr << "CHAINBASE: \"" << database_name << "\" cannot be loaded lazily without userfaultfd" << std::endl;
+#endif
+   return nullptr;
+}
+
+pinnable_mapped_file::lazy_loader::lazy_loader(bip::mapped_region&& source, bip::mapped_region&& region, int fd,
+                                               std::vector<uint64_t> checksums, const std::string& database_name, std::vector<bool> hot) :
+   _source(std::move(source)),
+   _region(std::move(region)),
+   _src((const char*)_source.get_address()),
+   _dst((char*)_region.get_address()),
+   _size(_source.get_size()),
+   _fd(fd),
+   _checksums(std::move(checksums)),
+   _database_name(database_name),
+   _hot(std::move(hot)),
+   _loaded(_size / _db_size_multiple_requirement),
+   _faulted(_loaded.size()),
+   _verified(_loaded.size()),
+   _bad(_loaded.size()),
+   _thread([this]{ run(); })
+{
+}
+
+pinnable_mapped_file::lazy_loader::~lazy_loader() {
+   _stop = true;
+   if(_thread.joinable())
+      _thread.join();
+}
+
+void pinnable_mapped_file::lazy_loader::wait() {
+   if(_thread.joinable())
+      _thread.join();
+   if(_error)
+      std::rethrow_exception(_error);
+}
+
+void pinnable_mapped_file::lazy_loader::run() {
+#ifdef __linux__
+   _hot.resize(_loaded.size());
+   size_t loaded = 0;
+   for(bool hot : {true, false}) {
+      for(size_t i = 0; i < _loaded.size() && !_stop; ++i) {
+         if(_hot[i] != hot)
+            continue;
+         while(serve_faults()) {}
+         copy(i * _db_size_multiple_requirement, (i + 1) * _db_size_multiple_requirement);
+         _loaded[i] = true;
+         ++loaded;
+      }
+   }
+   _complete = loaded == _loaded.size();
+   //only stopped early when the database is closed without saving, or after an error that left the rest of
+   //the pages to be filled with zeros by the kernel
+   uffdio_range range = {(uintptr_t)_dst, _size};
+   ioctl(_fd, UFFDIO_UNREGISTER, &range);
+   close(_fd);
+   if(_complete && !_error)
+      std::cerr << "CHAINBASE: \"" << _database_name << "\" database file has been loaded" << std::endl;
+   _source = bip::mapped_region();
+#endif
+}
+
+//keeps the first error for wait()
+void pinnable_mapped_file::lazy_loader::fail(std::exception_ptr error) {
+   try {
+      std::rethrow_exception(error);
+   } catch(const std::exception& e) {
+      std::cerr << "CHAINBASE: ERROR: " << e.what() << std::endl;
+   }
+   if(!_error)
+      _error = error;
+}
+
+//returns whether the chunk may be copied, checking it against its checksum the first time
+bool pinnable_mapped_file::lazy_loader::verify(size_t chunk) {
+   if(_verified[chunk] || _bad[chunk])
+      return _verified[chunk];
+   if(chunk_matches(_checksums, _src, chunk)) {
+      _verified[chunk] = true;
+   } else {
+      _bad[chunk] = true;
+      std::string what_str("\"" + _database_name + "\" database file does not match its checksum at offset " +
+                           std::to_string(chunk * _db_size_multiple_requirement));
+      fail(std::make_exception_ptr(std::system_error(make_error_code(db_error_code::bad_checksum), what_str)));
+   }
+   return _verified[chunk];
+}
+
+//The chunks accessed before they were loaded are hot.  Chunks that were hot before are loaded first, so
+//they are rarely accessed before they are loaded; they stay hot until the hot chunks make up half the file,
+//which starts them over from the chunks accessed this time.
+std::vector<bool> pinnable_mapped_file::lazy_loader::observed_hot_chunks() const {
+   if(!_complete)
+      return {};
+   std::vector<bool> hot = _faulted;
+   size_t count = 0;
+   for(size_t i = 0; i < hot.size(); ++i)
+      count += (hot[i] = hot[i] || _hot[i]);
+   return count * 2 > hot.size() ? _faulted : hot;
+}
+
+//loads the pages of the faults waiting to be served; returns whether there were any
+bool pinnable_mapped_file::lazy_loader::serve_faults() {
+#ifdef __linux__
+   uffd_msg msgs[16];
+   ssize_t n = read(_fd, msgs, sizeof(msgs));
+   if(n <= 0)
+      return false;
+   for(ssize_t i = 0; i < n / (ssize_t)sizeof(uffd_msg); ++i) {
+      if(msgs[i].event != UFFD_EVENT_PAGEFAULT)
+         continue;
+      const size_t begin = ((uintptr_t)msgs[i].arg.pagefault.address - (uintptr_t)_dst) & ~(fault_block - 1);
+      const size_t end = std::min(begin + fault_block, _size);
+      if(!_loaded[begin / _db_size_multiple_requirement])
+         _faulted[begin / _db_size_multiple_requirement] = true;
+      copy(begin, end);
+      //the page may have been loaded after the fault was reported, in which case copying it woke nobody
+      uffdio_range range = {(uintptr_t)_dst + begin, end - begin};
+      ioctl(_fd, UFFDIO_WAKE, &range);
+   }
+   return true;
+#else
+   return false;
+#endif
+}
+
+//loads the pages of [begin, end), which lie in one chunk, that have not been loaded yet
+void pinnable_mapped_file::lazy_loader::copy(size_t begin, size_t end) {
+#ifdef __linux__
+   if(!verify(begin / _db_size_multiple_requirement))
+      return zero(begin, end);
+   const size_t page_size = bip::mapped_region::get_page_size();
+   while(begin < end) {
+      uffdio_copy c = {};
+      c.dst = (uintptr_t)_dst + begin;
+      c.src = (uintptr_t)_src + begin;
+      c.len = end - begin;
+      if(ioctl(_fd, UFFDIO_COPY, &c) == 0)
+         return;
+      if(c.copy > 0)
+         begin += c.copy;
+      else if(c.copy == -EEXIST)
+         begin += page_size;
+      else if(c.copy != -EAGAIN) {
+         //a page that cannot be loaded would stop whoever accesses it forever
+         fail(std::make_exception_ptr(std::system_error(-c.copy, std::generic_category(),
+                                                        "loading \"" + _database_name + "\" database file failed")));
+         _bad[begin / _db_size_multiple_requirement] = true;
+         return zero(begin, end);
+      }
+   }
+#endif
+}
+
+//fills the pages of [begin, end) that have not been loaded yet with zeros
+void pinnable_mapped_file::lazy_loader::zero(size_t begin, size_t end) {
+#ifdef __linux__
+   const size_t page_size = bip::mapped_region::get_page_size();
+   while(begin < end) {
+      uffdio_zeropage z = {};
+      z.range.start = (uintptr_t)_dst + begin;
+      z.range.len = end - begin;
+      if(ioctl(_fd, UFFDIO_ZEROPAGE, &z) == 0)
+         return;
+      if(z.zeropage > 0)
+         begin += z.zeropage;
+      else if(z.zeropage == -EEXIST)
+         begin += page_size;
+      else if(z.zeropage != -EAGAIN) {
+         //leaves the pages that have not been loaded to the kernel, which fills them with zeros
+         fail(std::make_exception_ptr(std::system_error(-z.zeropage, std::generic_category(),
+                                                        "loading \"" + _database_name + "\" database file failed")));
+         uffdio_range range = {(uintptr_t)_dst, _size};
+         ioctl(_fd, UFFDIO_UNREGISTER, &range);
+         _stop = true;
+         return;
+      }
+   }
+#endif
+}
+
 pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty,
-                                          map_mode mode, std::vector<std::string> hugepage_paths) :
-   _data_file_path(bfs::absolute(dir/"shared_memory.bin")),
-   _database_name(dir.filename().string()),
-   _writable(writable)
+                                          map_mode mode, std::vector<std::string> hugepage_paths, const std::string& file_name, bool immutable) :
+   _data_file_path(bfs::absolute(dir/(file_name + ".bin"))),
+   _checksum_file_path(bfs::absolute(dir/(file_name + ".checksums"))),
+   _hot_chunks_file_path(bfs::absolute(dir/(file_name + ".hot"))),
+   _database_name(file_name == "shared_memory" ? dir.filename().string() : dir.filename().string() + "/" + file_name),
+   _writable(writable),
+   _mode(mode)
 {
    if(shared_file_size % _db_size_multiple_requirement) {
       std::string what_str("Database must be mulitple of " + std::to_string(_db_size_multiple_requirement) + " bytes");
@@ -68,8 +365,10 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
    if(hugepage_paths.size())
       BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_huge_page)));
 #endif
-   if(hugepage_paths.size() && mode != locked)
+   if(hugepage_paths.size() && mode != locked && mode != heap)
       BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::locked_mode_required)));
+   if(immutable && writable)
+      BOOST_THROW_EXCEPTION(std::logic_error("an immutable database cannot be opened for writing"));
 #ifdef _WIN32
    if(mode == locked)
       BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_locked_mode)));
@@ -98,7 +397,7 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
          std::string what_str("\"" + _database_name + "\" database dirty flag set");
          BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::dirty)));
       }
-      if(dbheader->dbenviron != environment()) {
+      if(!environment().is_compatible(dbheader->dbenviron)) {
          std::cerr << "CHAINBASE: \"" << _database_name << "\" database was created with a chainbase from a different environment" << std::endl;
          std::cerr << "Current compiler environment:" << std::endl;
          std::cerr << environment();
@@ -134,8 +433,14 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
          _file_mapping = bip::file_mapping(_data_file_path.generic_string().c_str(), bip::read_write);
          _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
          file_mapped_segment_manager = reinterpret_cast<segment_manager*>((char*)_file_mapped_region.get_address()+header_size);
-         if(grow)
+         if(grow) {
+            //growing changes the segment manager in the file, so its checksums no longer apply
+            boost::system::error_code ec;
+            bfs::remove(_checksum_file_path, ec);
             file_mapped_segment_manager->grow(grow);
+         }
+         //record the environment that now writes the database, including its segment layout if it was created without one
+         reinterpret_cast<db_header*>(_file_mapped_region.get_address())->dbenviron = environment();
    }
    else {
          _file_mapping = bip::file_mapping(_data_file_path.generic_string().c_str(), bip::read_only);
@@ -147,6 +452,9 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       //remove meta file created in earlier versions
       boost::system::error_code ec;
       bfs::remove(bfs::absolute(dir/"shared_memory.meta"), ec);
+      //in mapped mode the file changes while it is open, so its checksums go stale
+      if(mode == mapped)
+         bfs::remove(_checksum_file_path, ec);
 
       _mapped_file_lock = bip::file_lock(_data_file_path.generic_string().c_str());
       if(!_mapped_file_lock.try_lock())
@@ -155,9 +463,40 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       set_mapped_file_db_dirty(true);
    }
 
-   if(mode == mapped) {
+   //the first chunk is verified before the loader starts; a database that does not match was not changed
+   auto start_lazy_loader = [&] {
+      try {
+         return lazy_loader::start(_file_mapped_region, _checksum_file_path, _database_name,
+                                   read_hot_chunks(_file_mapped_region.get_size() / _db_size_multiple_requirement));
+      }
+      catch(...) {
+         if(_writable)
+            set_mapped_file_db_dirty(false);
+         throw;
+      }
+   };
+
+   if(immutable) {
+      if(hugepage_paths.size())
+         std::cerr << "CHAINBASE: Immutable database \"" << _database_name << "\" is read from the page cache, not using huge pages" << std::endl;
+      warm_page_cache(mode);
       _segment_manager = file_mapped_segment_manager;
    }
+   else if(mode == mapped) {
+      _segment_manager = file_mapped_segment_manager;
+#ifndef _WIN32
+      //start reading the chunks that were hot last time into the page cache
+      const std::vector<bool> hot = read_hot_chunks(_file_mapped_region.get_size() / _db_size_multiple_requirement);
+      for(size_t i = 0; i < hot.size(); ++i)
+         if(hot[i])
+            madvise((char*)_file_mapped_region.get_address() + i * _db_size_multiple_requirement, _db_size_multiple_requirement, MADV_WILLNEED);
+#endif
+   }
+   else if(mode == lazy && (_lazy_loader = start_lazy_loader())) {
+      _mapped_region = _lazy_loader->take_region();
+      _memory_backing = {{bip::mapped_region::get_page_size(), _mapped_region.get_size()}};
+      _segment_manager = reinterpret_cast<segment_manager*>((char*)_mapped_region.get_address()+header_size);
+   }
    else {
       boost::asio::io_service sig_ios;
       boost::asio::signal_set sig_set(sig_ios, SIGINT, SIGTERM);
@@ -169,16 +508,18 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       });
 
       try {
-         if(mode == heap)
+         if(mode == locked || hugepage_paths.size())
+            map_huge_region(hugepage_paths);
+         else {
             _mapped_region = bip::mapped_region(bip::anonymous_shared_memory(_file_mapped_region.get_size()));
-         else
-            _mapped_region = get_huge_region(hugepage_paths);
+            _memory_backing = {{bip::mapped_region::get_page_size(), _mapped_region.get_size()}};
+         }
 
          load_database_file(sig_ios);
 
          if(mode == locked) {
 #ifndef _WIN32
-            if(mlock(_mapped_region.get_address(), _mapped_region.get_size())) {
+            if(mlock(_mapped_region.get_address(), _file_mapped_region.get_size())) {
                std::string what_str("Failed to mlock database \"" + _database_name + "\"");
                BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_mlock), what_str));
 	       }
@@ -198,11 +539,15 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
    }
 }
 
-bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::string>& huge_paths) {
-   std::map<unsigned, std::string> page_size_to_paths;
-   const auto mapped_file_size = _file_mapped_region.get_size();
+//Maps the memory that the database is loaded into from the largest pages that fit: the bulk from the largest
+//page size, what remains from the next smaller size and so on, each part mapped right after the one before,
+//and what no huge page size fits from normal pages.  A page size without enough free pages is left out.
+void pinnable_mapped_file::map_huge_region(const std::vector<std::string>& huge_paths) {
+   const size_t size = _file_mapped_region.get_size();
+   const size_t normal_page_size = bip::mapped_region::get_page_size();
 
 #ifdef __linux__
+   std::map<size_t, std::string, std::greater<size_t>> page_size_to_paths;
    for(const std::string& p : huge_paths) {
       struct statfs fs;
       if(statfs(p.c_str(), &fs))
@@ -211,25 +556,77 @@ bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::
          BOOST_THROW_EXCEPTION(std::runtime_error(p + std::string(" does not look like a hugepagefs mount")));
       page_size_to_paths[fs.f_bsize] = p;
    }
-   for(auto it = page_size_to_paths.rbegin(); it != page_size_to_paths.rend(); ++it) {
-      if(mapped_file_size % it->first == 0) {
-         bfs::path hugepath = bfs::unique_path(bfs::path(it->second + "/%%%%%%%%%%%%%%%%%%%%%%%%%%"));
-         int fd = creat(hugepath.string().c_str(), _db_permissions.get_permissions());
-         if(fd < 0)
-            BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Could not open hugepage file in ") + it->second + ": " + std::string(strerror(errno))));
-         if(ftruncate(fd, mapped_file_size))
-            BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Failed to grow hugepage file to specified size")));
+
+   auto map_huge_pages = [&](const std::string& path, size_t part_size, char* address) {
+      bfs::path hugepath = bfs::unique_path(bfs::path(path + "/%%%%%%%%%%%%%%%%%%%%%%%%%%"));
+      int fd = creat(hugepath.string().c_str(), _db_permissions.get_permissions());
+      if(fd < 0)
+         BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Could not open hugepage file in ") + path + ": " + std::string(strerror(errno))));
+      if(ftruncate(fd, part_size)) {
          close(fd);
-         bip::file_mapping filemap(hugepath.generic_string().c_str(), _writable ? bip::read_write : bip::read_only);
          bfs::remove(hugepath);
-         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using " << it->first << " byte pages" << std::endl;
-         return bip::mapped_region(filemap, _writable ? bip::read_write : bip::read_only);
+         BOOST_THROW_EXCEPTION(std::runtime_error(std::string("Failed to grow hugepage file to specified size")));
       }
+      close(fd);
+      bip::file_mapping filemap(hugepath.generic_string().c_str(), bip::read_write);
+      bfs::remove(hugepath);
+      return bip::mapped_region(filemap, bip::read_write, 0, part_size, address);
+   };
+
+   //the parts are mapped at addresses found free beforehand, which another thread may take in between
+   for(int attempt = 0; attempt < 3 && page_size_to_paths.size(); ++attempt) {
+      const size_t alignment = page_size_to_paths.begin()->first;
+      void* reserved = mmap(nullptr, size + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if(reserved == MAP_FAILED)
+         break;
+      munmap(reserved, size + alignment);
+      char* const base = (char*)(((uintptr_t)reserved + alignment - 1) & ~(uintptr_t)(alignment - 1));
+
+      std::vector<bip::mapped_region> regions;
+      std::vector<backing_region> backing;
+      size_t offset = 0;
+      bool address_taken = false;
+      for(const auto& [page_size, path] : page_size_to_paths) {
+         const size_t part_size = (size - offset) / page_size * page_size;
+         if(!part_size)
+            continue;
+         try {
+            regions.push_back(map_huge_pages(path, part_size, base + offset));
+         }
+         catch(const bip::interprocess_exception& e) {
+            if(e.get_error_code() == bip::busy_error) {
+               address_taken = true;
+               break;
+            }
+            std::cerr << "CHAINBASE: Database \"" << _database_name << "\" could not get " << part_size << " bytes of "
+                      << page_size << " byte pages: " << e.what() << std::endl;
+            continue;
+         }
+         backing.push_back({page_size, part_size});
+         offset += part_size;
+      }
+      if(address_taken)
+         continue;
+      if(offset != size) {
+         regions.push_back(bip::mapped_region(bip::anonymous_shared_memory(size - offset, base + offset)));
+         if(regions.back().get_address() != base + offset)
+            continue;
+         backing.push_back({normal_page_size, size - offset});
+      }
+
+      _mapped_region = std::move(regions.front());
+      _tail_regions.clear();
+      std::move(regions.begin() + 1, regions.end(), std::back_inserter(_tail_regions));
+      _memory_backing = std::move(backing);
+      for(const backing_region& r : _memory_backing)
+         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" using " << r.page_size << " byte pages for " << r.size << " bytes" << std::endl;
+      return;
    }
 #endif
 
    std::cerr << "CHAINBASE: Database \"" << _database_name << "\" not using huge pages" << std::endl;
-   return bip::mapped_region(bip::anonymous_shared_memory(mapped_file_size));
+   _mapped_region = bip::mapped_region(bip::anonymous_shared_memory(size));
+   _memory_backing = {{normal_page_size, size}};
 }
 
 void pinnable_mapped_file::load_database_file(boost::asio::io_service& sig_ios) {
@@ -248,9 +645,311 @@ void pinnable_mapped_file::load_database_file(boost::asio::io_service& sig_ios)
       }
       sig_ios.poll();
    }
+   if(bfs::exists(_checksum_file_path)) {
+      std::cerr << "           Verifying checksums..." << std::endl;
+      verify_checksums(_checksum_file_path, _database_name, dst, _file_mapped_region.get_size());
+   }
    std::cerr << "           Complete" << std::endl;
 }
 
+namespace {
+
+constexpr uint64_t checksum_file_id = 0x4332334352434243ULL; //"CBCRC32C" little endian
+
+struct checksum_file_header {
+   uint64_t id = checksum_file_id;
+   uint64_t chunk_size = 0;
+   uint64_t chunk_count = 0;
+};
+
+//each chunk has one entry: 0 if the chunk was not written, otherwise checksum_present|crc
+constexpr uint64_t checksum_present = 1ULL << 32;
+
+constexpr uint64_t hot_chunks_file_id = 0x4b4843544f484243ULL; //"CBHOTCHK" little endian
+
+//followed by one bit per chunk, set if the chunk is hot
+struct hot_chunks_file_header {
+   uint64_t id = hot_chunks_file_id;
+   uint64_t chunk_size = 0;
+   uint64_t chunk_count = 0;
+};
+
+struct crc32c_table {
+   uint32_t entries[256];
+   constexpr crc32c_table() : entries{} {
+      for(uint32_t i = 0; i < 256; ++i) {
+         uint32_t c = i;
+         for(int k = 0; k < 8; ++k)
+            c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+         entries[i] = c;
+      }
+   }
+};
+constexpr crc32c_table crc32c_lookup;
+
+uint32_t crc32c_portable(uint32_t crc, const char* data, size_t size) {
+   for(size_t i = 0; i < size; ++i)
+      crc = crc32c_lookup.entries[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+   return crc;
+}
+
+#ifdef CHAINBASE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t size) {
+   uint64_t c = crc;
+   for(; size >= 8; data += 8, size -= 8) {
+      uint64_t v;
+      memcpy(&v, data, sizeof(v));
+      c = _mm_crc32_u64(c, v);
+   }
+   crc = (uint32_t)c;
+   for(; size; ++data, --size)
+      crc = _mm_crc32_u8(crc, (unsigned char)*data);
+   return crc;
+}
+#endif
+
+#ifdef CHAINBASE_CRC32C_ARM
+uint32_t crc32c_arm(uint32_t crc, const char* data, size_t size) {
+   for(; size >= 8; data += 8, size -= 8) {
+      uint64_t v;
+      memcpy(&v, data, sizeof(v));
+      crc = __crc32cd(crc, v);
+   }
+   for(; size; ++data, --size)
+      crc = __crc32cb(crc, (unsigned char)*data);
+   return crc;
+}
+#endif
+
+//CRC-32C (Castagnoli), using the crc32 instructions where available
+uint32_t crc32c(const char* data, size_t size) {
+   uint32_t crc = ~0u;
+#if defined(CHAINBASE_CRC32C_SSE42)
+   static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+   crc = has_sse42 ? crc32c_sse42(crc, data, size) : crc32c_portable(crc, data, size);
+#elif defined(CHAINBASE_CRC32C_ARM)
+   crc = crc32c_arm(crc, data, size);
+#else
+   crc = crc32c_portable(crc, data, size);
+#endif
+   return ~crc;
+}
+
+//calls f(i) for every i in [0, count) spread over all cores
+template<typename F>
+void for_each_parallel(size_t count, F&& f) {
+   std::atomic<size_t> next{0};
+   auto work = [&]() {
+      for(size_t i; (i = next++) < count;)
+         f(i);
+   };
+   std::vector<std::thread> threads;
+   const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+   for(unsigned t = 1; t < num_threads && t < count; ++t) {
+      try {
+         threads.emplace_back(work);
+      } catch(const std::system_error&) {
+         break;
+      }
+   }
+   work();
+   for(auto& t : threads)
+      t.join();
+}
+
+}
+
+//Returns the entry of each chunk of a database file of size bytes.
+std::vector<uint64_t> pinnable_mapped_file::read_checksums(const bfs::path& checksum_file_path, const std::string& database_name, size_t size) {
+   checksum_file_header header;
+   std::vector<uint64_t> entries;
+   std::ifstream cs(checksum_file_path.generic_string(), std::ifstream::binary);
+   cs.read((char*)&header, sizeof(header));
+   const size_t chunks = size / _db_size_multiple_requirement;
+   if(cs.fail() || header.id != checksum_file_id || header.chunk_size != _db_size_multiple_requirement || header.chunk_count > chunks) {
+      std::string what_str("\"" + database_name + "\" database checksum file is not valid");
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_checksum), what_str));
+   }
+   entries.resize(header.chunk_count);
+   cs.read((char*)entries.data(), entries.size() * sizeof(uint64_t));
+   if(cs.fail()) {
+      std::string what_str("\"" + database_name + "\" database checksum file is truncated");
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_checksum), what_str));
+   }
+   return entries;
+}
+
+//The header is excluded from the checksums because its dirty flag is written directly to the file.
+bool pinnable_mapped_file::chunk_matches(const std::vector<uint64_t>& checksums, const char* data, size_t chunk) {
+   if(chunk >= checksums.size() || !(checksums[chunk] & checksum_present))
+      return true;
+   const size_t begin = chunk ? chunk * _db_size_multiple_requirement : header_size;
+   const size_t end = (chunk + 1) * _db_size_multiple_requirement;
+   return crc32c(data + begin, end - begin) == (uint32_t)checksums[chunk];
+}
+
+void pinnable_mapped_file::verify_checksums(const bfs::path& checksum_file_path, const std::string& database_name,
+                                            const char* data, size_t size) {
+   const std::vector<uint64_t> entries = read_checksums(checksum_file_path, database_name, size);
+
+   std::atomic<size_t> first_bad{entries.size()};
+   for_each_parallel(entries.size(), [&](size_t i) {
+      if(!chunk_matches(entries, data, i)) {
+         size_t expected = first_bad.load();
+         while(i < expected && !first_bad.compare_exchange_weak(expected, i)) {}
+      }
+   });
+   if(first_bad != entries.size()) {
+      std::string what_str("\"" + database_name + "\" database file does not match its checksum at offset " +
+                           std::to_string(first_bad * _db_size_multiple_requirement));
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_checksum), what_str));
+   }
+}
+
+void pinnable_mapped_file::warm_page_cache(map_mode mode) {
+   char* const data = (char*)_file_mapped_region.get_address();
+   const size_t size = _file_mapped_region.get_size();
+   if(mode == mapped)
+      return;
+#ifndef _WIN32
+   madvise(data, size, MADV_WILLNEED);
+#endif
+   if(mode == lazy)
+      return;
+
+   std::cerr << "CHAINBASE: Reading \"" << _database_name << "\" database file into the page cache, this could take a moment..." << std::endl;
+   //verifying the checksums reads every chunk that was written
+   if(bfs::exists(_checksum_file_path)) {
+      std::cerr << "           Verifying checksums..." << std::endl;
+      verify_checksums(_checksum_file_path, _database_name, data, size);
+   }
+   else {
+      const size_t page_size = bip::mapped_region::get_page_size();
+      std::atomic<char> sink{0};
+      for_each_parallel(size / _db_size_multiple_requirement, [&](size_t i) {
+         char c = 0;
+         for(size_t offset = 0; offset < _db_size_multiple_requirement; offset += page_size)
+            c ^= ((volatile const char*)data)[i * _db_size_multiple_requirement + offset];
+         sink ^= c;
+      });
+   }
+   if(mode == locked) {
+#ifndef _WIN32
+      if(mlock(data, size)) {
+         std::string what_str("Failed to mlock database \"" + _database_name + "\"");
+         BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_mlock), what_str));
+      }
+#endif
+   }
+   std::cerr << "           Complete" << std::endl;
+}
+
+void pinnable_mapped_file::write_checksums(const char* data, size_t size, const std::vector<bool>& written) {
+   checksum_file_header header;
+   header.chunk_size = _db_size_multiple_requirement;
+   header.chunk_count = size / _db_size_multiple_requirement;
+   std::vector<uint64_t> entries(header.chunk_count);
+   for_each_parallel(entries.size(), [&](size_t i) {
+      if(!written[i])
+         return;
+      const size_t begin = i ? i * _db_size_multiple_requirement : header_size;
+      const size_t end = (i + 1) * _db_size_multiple_requirement;
+      entries[i] = checksum_present | crc32c(data + begin, end - begin);
+   });
+
+   //written under another name first, so that a partially written checksum file is never used
+   bfs::path temp_path = _checksum_file_path;
+   temp_path += ".tmp";
+   {
+      std::ofstream cs(temp_path.generic_string(), std::ofstream::binary | std::ofstream::trunc);
+      cs.write((const char*)&header, sizeof(header));
+      cs.write((const char*)entries.data(), entries.size() * sizeof(uint64_t));
+      cs.flush();
+      if(cs.fail()) {
+         std::cerr << "CHAINBASE: ERROR: writing checksums of \"" << _database_name << "\" database failed" << std::endl;
+         return;
+      }
+   }
+   boost::system::error_code ec;
+   bfs::rename(temp_path, _checksum_file_path, ec);
+   if(ec)
+      std::cerr << "CHAINBASE: ERROR: writing checksums of \"" << _database_name << "\" database failed: " << ec.message() << std::endl;
+}
+
+//returns the hot chunks recorded for a file of chunk_count chunks; none if there is no valid record
+std::vector<bool> pinnable_mapped_file::read_hot_chunks(size_t chunk_count) const {
+   std::vector<bool> hot(chunk_count);
+   std::ifstream hs(_hot_chunks_file_path.generic_string(), std::ifstream::binary);
+   hot_chunks_file_header header;
+   hs.read((char*)&header, sizeof(header));
+   if(hs.fail() || header.id != hot_chunks_file_id || header.chunk_size != _db_size_multiple_requirement)
+      return hot;
+   std::vector<unsigned char> bits((header.chunk_count + 7) / 8);
+   hs.read((char*)bits.data(), bits.size());
+   if(hs.fail())
+      return hot;
+   for(size_t i = 0; i < std::min<size_t>(chunk_count, header.chunk_count); ++i)
+      hot[i] = bits[i / 8] & (1 << (i % 8));
+   return hot;
+}
+
+void pinnable_mapped_file::write_hot_chunks(const std::vector<bool>& hot) const {
+   boost::system::error_code ec;
+   if(std::find(hot.begin(), hot.end(), true) == hot.end()) {
+      bfs::remove(_hot_chunks_file_path, ec);
+      return;
+   }
+   hot_chunks_file_header header;
+   header.chunk_size = _db_size_multiple_requirement;
+   header.chunk_count = hot.size();
+   std::vector<unsigned char> bits((hot.size() + 7) / 8);
+   for(size_t i = 0; i < hot.size(); ++i)
+      if(hot[i])
+         bits[i / 8] |= 1 << (i % 8);
+
+   bfs::path temp_path = _hot_chunks_file_path;
+   temp_path += ".tmp";
+   {
+      std::ofstream hs(temp_path.generic_string(), std::ofstream::binary | std::ofstream::trunc);
+      hs.write((const char*)&header, sizeof(header));
+      hs.write((const char*)bits.data(), bits.size());
+      hs.flush();
+      if(hs.fail()) {
+         std::cerr << "CHAINBASE: ERROR: recording hot chunks of \"" << _database_name << "\" database failed" << std::endl;
+         return;
+      }
+   }
+   bfs::rename(temp_path, _hot_chunks_file_path, ec);
+   if(ec)
+      std::cerr << "CHAINBASE: ERROR: recording hot chunks of \"" << _database_name << "\" database failed: " << ec.message() << std::endl;
+}
+
+//Records the chunks to load first next time.  In lazy mode these are the chunks accessed before they were
+//loaded, see lazy_loader::observed_hot_chunks.  In mapped mode they are the chunks in the page cache, unless
+//that is most of the file, which tells nothing.  Heap and locked mode cannot tell and keep the last record.
+void pinnable_mapped_file::record_hot_chunks() {
+   if(_lazy_loader) {
+      std::vector<bool> hot = _lazy_loader->observed_hot_chunks();
+      if(hot.size())
+         write_hot_chunks(hot);
+   }
+#ifdef __linux__
+   else if(_mode == mapped && _file_mapped_region.get_address()) {
+      const size_t page_size = bip::mapped_region::get_page_size();
+      std::vector<bool> hot(_file_mapped_region.get_size() / _db_size_multiple_requirement);
+      std::vector<unsigned char> resident(_db_size_multiple_requirement / page_size);
+      size_t count = 0;
+      for(size_t i = 0; i < hot.size(); ++i) {
+         if(mincore((char*)_file_mapped_region.get_address() + i * _db_size_multiple_requirement, _db_size_multiple_requirement, resident.data()))
+            return;
+         count += (hot[i] = std::any_of(resident.begin(), resident.end(), [](unsigned char r) { return r & 1; }));
+      }
+      write_hot_chunks(count * 2 > hot.size() ? std::vector<bool>() : hot);
+   }
+#endif
+}
+
 bool pinnable_mapped_file::all_zeros(char* data, size_t sz) {
    uint64_t* p = (uint64_t*)data;
    uint64_t* end = p+sz/sizeof(uint64_t);
@@ -267,9 +966,15 @@ void pinnable_mapped_file::save_database_file() {
    char* dst = (char*)_file_mapped_region.get_address();
    size_t offset = 0;
    time_t t = time(nullptr);
+   //the old checksums no longer apply once the file starts changing
+   boost::system::error_code ec;
+   bfs::remove(_checksum_file_path, ec);
+   std::vector<bool> written(_file_mapped_region.get_size() / _db_size_multiple_requirement);
    while(offset != _file_mapped_region.get_size()) {
-      if(!all_zeros(src+offset, _db_size_multiple_requirement))
+      if(!all_zeros(src+offset, _db_size_multiple_requirement)) {
          memcpy(dst+offset, src+offset, _db_size_multiple_requirement);
+         written[offset / _db_size_multiple_requirement] = true;
+      }
       offset += _db_size_multiple_requirement;
 
       if(time(nullptr) != t) {
@@ -280,36 +985,87 @@ void pinnable_mapped_file::save_database_file() {
    std::cerr << "           Syncing buffers..." << std::endl;
    if(_file_mapped_region.flush(0, 0, false) == false)
       std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
+   else {
+      std::cerr << "           Writing checksums..." << std::endl;
+      write_checksums(src, _file_mapped_region.get_size(), written);
+   }
    std::cerr << "           Complete" << std::endl;
 }
 
 pinnable_mapped_file::pinnable_mapped_file(pinnable_mapped_file&& o) :
    _mapped_file_lock(std::move(o._mapped_file_lock)),
    _data_file_path(std::move(o._data_file_path)),
+   _checksum_file_path(std::move(o._checksum_file_path)),
+   _hot_chunks_file_path(std::move(o._hot_chunks_file_path)),
    _database_name(std::move(o._database_name)),
+   _file_mapping(std::move(o._file_mapping)),
    _file_mapped_region(std::move(o._file_mapped_region)),
-   _mapped_region(std::move(o._mapped_region))
+   _mapped_region(std::move(o._mapped_region)),
+   _tail_regions(std::move(o._tail_regions)),
+   _memory_backing(std::move(o._memory_backing)),
+   _lazy_loader(std::move(o._lazy_loader))
 {
    _segment_manager = o._segment_manager;
    _writable = o._writable;
+   _mode = o._mode;
+   _speculating = o._speculating;
+   _written_back_partly = o._written_back_partly;
    o._writable = false; //prevent dtor from doing anything interesting
+   o._speculating = false;
 }
 
 pinnable_mapped_file& pinnable_mapped_file::operator=(pinnable_mapped_file&& o) {
    _mapped_file_lock = std::move(o._mapped_file_lock);
    _data_file_path = std::move(o._data_file_path);
+   _checksum_file_path = std::move(o._checksum_file_path);
+   _hot_chunks_file_path = std::move(o._hot_chunks_file_path);
    _database_name = std::move(o._database_name);
+   _file_mapping = std::move(o._file_mapping);
    _file_mapped_region = std::move(o._file_mapped_region);
    _mapped_region = std::move(o._mapped_region);
+   _tail_regions = std::move(o._tail_regions);
+   _memory_backing = std::move(o._memory_backing);
+   _lazy_loader = std::move(o._lazy_loader);
    _segment_manager = o._segment_manager;
    _writable = o._writable;
+   _mode = o._mode;
+   _speculating = o._speculating;
+   _written_back_partly = o._written_back_partly;
    o._writable = false; //prevent dtor from doing anything interesting
+   o._speculating = false;
    return *this;
 }
 
 pinnable_mapped_file::~pinnable_mapped_file() {
+   if(_written_back_partly) {
+      std::cerr << "CHAINBASE: ERROR: speculative changes to \"" << _database_name << "\" database were only partly written back, so it is left dirty" << std::endl;
+      return;
+   }
+   if(_speculating) {
+      try {
+         discard_speculation();
+      } catch(const std::exception& e) {
+         std::cerr << "CHAINBASE: ERROR: discarding speculative changes to \"" << _database_name << "\" database failed: " << e.what() << std::endl;
+         return;
+      }
+   }
+   if(_lazy_loader) {
+      //saving reads every page, so the load must be complete; a chunk that failed to load has already been
+      //reported and holds zeros, which must not replace it in the file, so the file is left dirty instead
+      if(_writable) {
+         try {
+            _lazy_loader->wait();
+         } catch(const std::exception&) {
+            std::cerr << "CHAINBASE: ERROR: \"" << _database_name << "\" database was not loaded completely, so it is not saved" << std::endl;
+            return;
+         }
+      }
+   }
+   if(_writable)
+      record_hot_chunks();
+   _lazy_loader.reset();
    if(_writable) {
-      if(_mapped_region.get_address()) { //in heap or locked mode
+      if(_mapped_region.get_address()) { //in heap, locked or lazy mode
          _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
          save_database_file();
       }
@@ -320,12 +1076,285 @@ pinnable_mapped_file::~pinnable_mapped_file() {
    }
 }
 
+//While speculating, the database file is mapped privately at the same address, so the kernel copies
+//each page on its first write and the file keeps the state from before the speculation.  Mapping the
+//file shared again discards the copies; committing first writes only the copied pages back to the file.
+//Once a write back fails, the file holds some copied pages and some from before, so the speculation can
+//no longer be discarded, and the file stays dirty unless a later commit writes every copied page.
+void pinnable_mapped_file::start_speculation() {
+   if(!_writable || _mode != mapped || _speculating)
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_speculation)));
+   remap_file(false);
+   _speculating = true;
+}
+
+void pinnable_mapped_file::discard_speculation() {
+   if(!_speculating)
+      return;
+   if(_written_back_partly)
+      BOOST_THROW_EXCEPTION(std::logic_error("speculative changes to \"" + _database_name + "\" database were partly written back, so they can only be committed"));
+   remap_file(true);
+   _speculating = false;
+}
+
+void pinnable_mapped_file::commit_speculation() {
+   if(!_speculating)
+      return;
+#ifndef _WIN32
+   const char* const base = (const char*)_file_mapped_region.get_address();
+   const size_t size = _file_mapped_region.get_size();
+   const size_t page_size = bip::mapped_region::get_page_size();
+   const int fd = _file_mapping.get_mapping_handle().handle;
+   auto write_back = [&](size_t begin, size_t end) {
+      while(begin != end) {
+         ssize_t written = pwrite(fd, base + begin, end - begin, begin);
+         if(written < 0) {
+            if(errno == EINTR)
+               continue;
+            _written_back_partly = true;
+            BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "writing speculative changes to \"" + _database_name + "\" database failed"));
+         }
+         begin += written;
+      }
+   };
+   bool found_copies = false;
+#ifdef __linux__
+   //a page that was copied on write is anonymous memory: either present (bit 63) and not a file
+   //page (bit 61), or swapped out (bit 62).  Pages that were never written still belong to the file.
+   int pagemap = open("/proc/self/pagemap", O_RDONLY);
+   if(pagemap >= 0) {
+      const size_t pages = size / page_size;
+      const uint64_t first_entry = (uint64_t)(uintptr_t)base / page_size * sizeof(uint64_t);
+      std::vector<uint64_t> entries(std::min<size_t>(pages, 4096));
+      std::vector<std::pair<size_t, size_t>> runs;
+      found_copies = true;
+      for(size_t page = 0; page < pages;) {
+         const size_t count = std::min(entries.size(), pages - page);
+         if(pread(pagemap, entries.data(), count * sizeof(uint64_t), first_entry + page * sizeof(uint64_t)) != (ssize_t)(count * sizeof(uint64_t))) {
+            found_copies = false;
+            break;
+         }
+         for(size_t i = 0; i < count; ++i, ++page) {
+            const uint64_t e = entries[i];
+            if(((e >> 63) & 1 && !((e >> 61) & 1)) || ((e >> 62) & 1)) {
+               if(!runs.empty() && runs.back().second == page * page_size)
+                  runs.back().second += page_size;
+               else
+                  runs.emplace_back(page * page_size, (page + 1) * page_size);
+            }
+         }
+      }
+      close(pagemap);
+      if(found_copies)
+         for(const auto& [begin, end] : runs)
+            write_back(begin, end);
+   }
+#endif
+   //without a way to find the copied pages, everything is written back
+   if(!found_copies)
+      write_back(0, size);
+#endif
+   remap_file(true);
+   _speculating = false;
+   _written_back_partly = false;
+}
+
+void pinnable_mapped_file::remap_file(bool shared) {
+#ifdef _WIN32
+   BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_speculation)));
+#else
+   void* const addr = _file_mapped_region.get_address();
+   const int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED;
+   if(mmap(addr, _file_mapped_region.get_size(), PROT_READ | PROT_WRITE, flags, _file_mapping.get_mapping_handle().handle, 0) == MAP_FAILED)
+      BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "remapping \"" + _database_name + "\" database failed"));
+#endif
+}
+
+void pinnable_mapped_file::wait_for_load() {
+   if(_lazy_loader)
+      _lazy_loader->wait();
+}
+
 void pinnable_mapped_file::set_mapped_file_db_dirty(bool dirty) {
    *((char*)_file_mapped_region.get_address()+header_dirty_bit_offset) = dirty;
    if(_file_mapped_region.flush(0, 0, false) == false)
       std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
 }
 
+namespace {
+
+#ifndef _WIN32
+[[noreturn]] void throw_clone_error(const bfs::path& path) {
+   BOOST_THROW_EXCEPTION(std::system_error(errno, std::generic_category(), "cloning " + path.string() + " failed"));
+}
+
+//copies [begin, end) of src to dst, which is already large enough and reads as zeros there
+void copy_file_range_data(int src, int dst, off_t begin, off_t end, const bfs::path& path) {
+#ifdef __linux__
+   while(begin < end) {
+      loff_t in = begin, out = begin;
+      ssize_t copied = copy_file_range(src, &in, dst, &out, end - begin, 0);
+      if(copied > 0)
+         begin += copied;
+      else if(copied < 0 && errno == EINTR)
+         continue;
+      else if(copied < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+         throw_clone_error(path);
+      else
+         break;
+   }
+#endif
+   //zero blocks are left out, so that they stay holes
+   std::vector<char> buffer(1024*1024);
+   while(begin < end) {
+      ssize_t n = pread(src, buffer.data(), std::min<off_t>(buffer.size(), end - begin), begin);
+      if(n < 0 && errno == EINTR)
+         continue;
+      if(n <= 0)
+         throw_clone_error(path);
+      if(std::any_of(buffer.begin(), buffer.begin() + n, [](char c) { return c != 0; })) {
+         for(ssize_t written = 0; written < n;) {
+            ssize_t w = pwrite(dst, buffer.data() + written, n - written, begin + written);
+            if(w < 0 && errno == EINTR)
+               continue;
+            if(w <= 0)
+               throw_clone_error(path);
+            written += w;
+         }
+      }
+      begin += n;
+   }
+}
+
+//copies the file at src_path to dst_path, which must not exist, sharing its blocks if possible and
+//otherwise copying only its data, so that holes stay holes
+void clone_file(const bfs::path& src_path, const bfs::path& dst_path) {
+   int src = open(src_path.c_str(), O_RDONLY | O_CLOEXEC);
+   if(src < 0)
+      throw_clone_error(src_path);
+   struct stat st;
+   if(fstat(src, &st)) {
+      close(src);
+      throw_clone_error(src_path);
+   }
+   int dst = open(dst_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777);
+   if(dst < 0) {
+      close(src);
+      throw_clone_error(dst_path);
+   }
+   auto close_files = [&]() {
+      close(src);
+      close(dst);
+   };
+   try {
+#ifdef FICLONE
+      if(ioctl(dst, FICLONE, src) == 0) {
+         if(fsync(dst))
+            throw_clone_error(dst_path);
+         close_files();
+         return;
+      }
+#endif
+      if(ftruncate(dst, st.st_size))
+         throw_clone_error(dst_path);
+      off_t begin = 0;
+      while(begin < st.st_size) {
+         off_t data = begin, hole = st.st_size;
+#ifdef SEEK_DATA
+         data = lseek(src, begin, SEEK_DATA);
+         if(data < 0 && errno == ENXIO)
+            break;
+         if(data < 0 && errno != EINVAL)
+            throw_clone_error(src_path);
+         if(data < 0)
+            data = begin;
+         else if((hole = lseek(src, data, SEEK_HOLE)) < 0)
+            hole = st.st_size;
+#endif
+         copy_file_range_data(src, dst, data, hole, src_path);
+         begin = hole;
+      }
+      if(fsync(dst))
+         throw_clone_error(dst_path);
+   }
+   catch(...) {
+      close_files();
+      unlink(dst_path.c_str());
+      throw;
+   }
+   close_files();
+}
+#endif
+
+void check_clean_header(const bfs::path& path) {
+   char header[header_size];
+   std::ifstream hs(path.generic_string(), std::ifstream::binary);
+   hs.read(header, header_size);
+   if(hs.fail())
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_header)));
+   db_header* dbheader = reinterpret_cast<db_header*>(header);
+   if(dbheader->id != header_id) {
+      std::string what_str(path.string() + " database format not compatible with this version of chainbase.");
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::incorrect_db_version), what_str));
+   }
+   if(dbheader->dirty) {
+      std::string what_str(path.string() + " database dirty flag set");
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::dirty), what_str));
+   }
+}
+
+}
+
+void clone_database(const bfs::path& src_dir, const bfs::path& dst_dir) {
+   if(!bfs::exists(src_dir/"shared_memory.bin")) {
+      std::string what_str("database file not found at " + (src_dir/"shared_memory.bin").string());
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::not_found), what_str));
+   }
+
+   std::vector<bfs::path> files;
+   for(const bfs::directory_entry& entry : bfs::directory_iterator(src_dir)) {
+      const bfs::path extension = entry.path().extension();
+      if(bfs::is_regular_file(entry.status()) && (extension == ".bin" || extension == ".checksums" || extension == ".hot"))
+         files.push_back(entry.path());
+   }
+
+   //file locks belong to the process, so unlocking a database that this process has open for writing would
+   //release its lock; such a database is dirty, and is refused before it is locked
+   std::vector<bip::file_lock> locks;
+   for(const bfs::path& path : files) {
+      if(path.extension() != ".bin")
+         continue;
+      check_clean_header(path);
+      locks.emplace_back(path.generic_string().c_str());
+      if(!locks.back().try_lock())
+         BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_access)));
+      check_clean_header(path);
+   }
+
+   bfs::create_directories(dst_dir);
+   for(const bfs::path& path : files) {
+      if(bfs::exists(dst_dir/path.filename()))
+         BOOST_THROW_EXCEPTION(std::system_error(std::make_error_code(std::errc::file_exists), (dst_dir/path.filename()).string()));
+   }
+   std::vector<bfs::path> cloned;
+   try {
+      for(const bfs::path& path : files) {
+#ifdef _WIN32
+         bfs::copy_file(path, dst_dir/path.filename());
+#else
+         clone_file(path, dst_dir/path.filename());
+#endif
+         cloned.push_back(dst_dir/path.filename());
+      }
+   }
+   catch(...) {
+      boost::system::error_code ec;
+      for(const bfs::path& path : cloned)
+         bfs::remove(path, ec);
+      throw;
+   }
+}
+
 std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runtime) {
    std::string s;
    in >> s;
@@ -335,6 +1364,8 @@ std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runti
       runtime = pinnable_mapped_file::map_mode::heap;
    else if (s == "locked")
       runtime = pinnable_mapped_file::map_mode::locked;
+   else if (s == "lazy")
+      runtime = pinnable_mapped_file::map_mode::lazy;
    else
       in.setstate(std::ios_base::failbit);
    return in;
@@ -347,6 +1378,8 @@ std::ostream& operator<<(std::ostream& osm, pinnable_mapped_file::map_mode m) {
       osm << "heap";
    else if (m == pinnable_mapped_file::map_mode::locked)
       osm << "locked";
+   else if (m == pinnable_mapped_file::map_mode::lazy)
+      osm << "lazy";
 
    return osm;
 }
@@ -378,6 +1411,19 @@ std::ostream& operator<<(std::ostream& os, const chainbase::environment& dt) {
    os << std::right << std::setw(17) << "Boost: " << dt.boost_version/100000 << "."
                                                   << dt.boost_version/100%1000 << "."
                                                   << dt.boost_version%100 << std::endl;
+   if(dt.layout.recorded())
+      os << std::right << std::setw(17) << "Segment layout: " << "format " << dt.layout.format
+                                                           << ", " << (dt.layout.little_endian ? "little" : "big") << " endian"
+                                                           << ", pointer " << (unsigned)dt.layout.pointer_size
+                                                           << ", long " << (unsigned)dt.layout.long_size
+                                                           << ", max align " << (unsigned)dt.layout.max_align
+                                                           << ", offset_ptr " << dt.layout.offset_ptr_size
+                                                           << ", segment manager " << dt.layout.segment_manager_size
+                                                           << ", allocator " << dt.layout.memory_algorithm_size
+                                                           << "/" << dt.layout.allocation_alignment
+                                                           << "/" << dt.layout.allocation_overhead << std::endl;
+   else
+      os << std::right << std::setw(17) << "Segment layout: " << "not recorded" << std::endl;
    return os;
 }
 
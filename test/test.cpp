@@ -2,12 +2,21 @@
 
 #include <boost/test/unit_test.hpp>
 #include <chainbase/chainbase.hpp>
+#include <chainbase/environment.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
 
+#include <atomic>
+#include <csignal>
 #include <iostream>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
 
 using namespace chainbase;
 using namespace boost::multi_index;
@@ -66,6 +75,13 @@ BOOST_AUTO_TEST_CASE( open_and_create ) {
       BOOST_REQUIRE_EQUAL( new_book.a, copy_new_book.a );
       BOOST_REQUIRE_EQUAL( new_book.b, copy_new_book.b );
 
+      std::vector<book::id_type> ids = { book::id_type(1), book::id_type(0) };
+      std::vector<const book*> found;
+      db.find_many<book>( ids.begin(), ids.end(), std::back_inserter(found) );
+      BOOST_REQUIRE_EQUAL( found.size(), 2u );
+      BOOST_REQUIRE( found[0] == nullptr );
+      BOOST_REQUIRE( found[1] == &new_book );
+
       db.modify( new_book, [&]( book& b ) {
           b.a = 5;
           b.b = 6;
@@ -132,4 +148,1083 @@ BOOST_AUTO_TEST_CASE( open_and_create ) {
    bfs::remove_all( temp );
 }
 
+struct shelf : public chainbase::object<1, shelf> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( shelf )
+
+   id_type id;
+   int a = 0;
+   int b = 0;
+};
+
+typedef multi_index_container<
+  shelf,
+  indexed_by<
+     ordered_unique< member<shelf,shelf::id_type,&shelf::id> >,
+     ordered_unique< BOOST_MULTI_INDEX_MEMBER(shelf,int,a) >
+  >,
+  chainbase::node_allocator<shelf>
+> shelf_index_v1;
+
+struct by_b;
+typedef multi_index_container<
+  shelf,
+  indexed_by<
+     ordered_unique< member<shelf,shelf::id_type,&shelf::id> >,
+     ordered_unique< BOOST_MULTI_INDEX_MEMBER(shelf,int,a) >,
+     ordered_unique< tag<by_b>, BOOST_MULTI_INDEX_MEMBER(shelf,int,b) >
+  >,
+  chainbase::node_allocator<shelf>
+> shelf_index;
+
+CHAINBASE_SET_INDEX_TYPE( shelf, shelf_index )
+
+BOOST_AUTO_TEST_CASE( upgrade_index ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< shelf_index_v1 >();
+         auto& idx = db.get_mutable_index< shelf_index_v1 >();
+         for( int i = 0; i < 100; ++i ) {
+            idx.emplace( [&]( shelf& s ) { s.a = i; s.b = (i * 37) % 100; } );
+         }
+         idx.remove( *idx.find( 10 ) );
+         db.set_revision( 5 );
+         // as left by an upgrade that stopped before it replaced the stored table, which is still complete
+         const std::string upgrade_name = boost::core::demangle( typeid( shelf ).name() ) + "@upgrade";
+         auto* segment = db.get_segment_manager();
+         segment->construct< generic_index<shelf_index> >( upgrade_name.c_str() )( generic_index<shelf_index>::allocator_type( segment ) )->copy_from( idx );
+         BOOST_TEST( idx.size() == 99u );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.upgrade_index< shelf_index, shelf_index_v1 >();
+         BOOST_TEST( db.revision() == 5 );
+         const auto& by_id = db.get_index< shelf_index >().indices();
+         BOOST_TEST( by_id.size() == 99u );
+         BOOST_TEST( db.find< shelf >( shelf::id_type(10) ) == nullptr );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(11) ).a == 11 );
+         const auto& sorted_b = db.get_index< shelf_index, by_b >();
+         int expected = 0;
+         for( const auto& s : sorted_b ) {
+            if( expected == 70 ) ++expected; // (10 * 37) % 100 was removed
+            BOOST_TEST( s.b == expected++ );
+         }
+         const auto& created = db.create< shelf >( []( shelf& s ) { s.a = 200; s.b = 200; } );
+         BOOST_TEST( created.id._id == 100 );
+         BOOST_TEST( (db.find< shelf, by_b >( 200 ) == &created) );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.upgrade_index< shelf_index, shelf_index_v1 >(); /// already upgraded
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 100u );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( upgrade_index_free_nodes ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< shelf_index_v1 >();
+         for( int i = 0; i < 100; ++i ) {
+            db.get_mutable_index< shelf_index_v1 >().emplace( [&]( shelf& s ) { s.a = i; s.b = i; } );
+         }
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.upgrade_index< shelf_index, shelf_index_v1 >();
+         // nodes are allocated 64 at a time, and the ones that the upgrade left over are used first
+         const auto free_memory = db.get_segment_manager()->get_free_memory();
+         for( int i = 100; i < 128; ++i ) {
+            db.create< shelf >( [&]( shelf& s ) { s.a = i; s.b = i; } );
+         }
+         BOOST_TEST( db.get_segment_manager()->get_free_memory() == free_memory );
+         db.create< shelf >( []( shelf& s ) { s.a = 128; s.b = 128; } );
+         BOOST_TEST( db.get_segment_manager()->get_free_memory() < free_memory );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+struct crate_v1 : public chainbase::object<2, crate_v1> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( crate_v1 )
+
+   id_type id;
+   int32_t weight = 0;
+};
+
+typedef multi_index_container<
+  crate_v1,
+  indexed_by<
+     ordered_unique< member<crate_v1,crate_v1::id_type,&crate_v1::id> >
+  >,
+  chainbase::node_allocator<crate_v1>
+> crate_index_v1;
+
+struct crate : public chainbase::object<2, crate> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( crate )
+
+   id_type id;
+   int64_t grams = 0;
+};
+
+struct by_grams;
+typedef multi_index_container<
+  crate,
+  indexed_by<
+     ordered_unique< member<crate,crate::id_type,&crate::id> >,
+     ordered_unique< tag<by_grams>, BOOST_MULTI_INDEX_MEMBER(crate,int64_t,grams) >
+  >,
+  chainbase::node_allocator<crate>
+> crate_index;
+
+CHAINBASE_SET_INDEX_TYPE( crate, crate_index )
+CHAINBASE_SET_LAYOUT_VERSION( crate, 2 )
+
+BOOST_AUTO_TEST_CASE( migrate_index ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const std::string crate_name = boost::core::demangle( typeid( crate ).name() );
+   try {
+      {
+         // A table written by an executable where crate had the layout of crate_v1
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         auto* segment = db.get_segment_manager();
+         auto* idx = segment->construct< generic_index<crate_index_v1> >( crate_name.c_str() )( generic_index<crate_index_v1>::allocator_type( segment ) );
+         for( int i = 0; i < 3000; ++i ) {
+            idx->emplace( [&]( crate_v1& c ) { c.weight = i; } );
+         }
+         idx->remove( *idx->find( 7 ) );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.migrate_index< crate_index, crate_index_v1 >( []( const crate_v1& old_crate, crate& c ) {
+            c.grams = int64_t( 3000 - old_crate.weight ) * 1000;
+         } );
+         const auto& by_id = db.get_index< crate_index >().indices();
+         BOOST_TEST( by_id.size() == 2999u );
+         BOOST_TEST( db.find< crate >( crate::id_type(7) ) == nullptr );
+         BOOST_TEST( db.get< crate >( crate::id_type(8) ).grams == 2992000 );
+         const auto& sorted_grams = db.get_index< crate_index, by_grams >();
+         BOOST_TEST( sorted_grams.begin()->id._id == 2999 );
+         BOOST_TEST( db.create< crate >( []( crate& c ) { c.grams = 1; } ).id._id == 3000 );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.migrate_index< crate_index, crate_index_v1 >( []( const crate_v1&, crate& ) {} ); /// already migrated
+         BOOST_TEST( db.get_index< crate_index >().indices().size() == 3000u );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         auto* layout = db.get_segment_manager()->find< index_layout >( ( crate_name + "@layout" ).c_str() ).first;
+         BOOST_REQUIRE( layout != nullptr );
+         BOOST_TEST( layout->version == 2u );
+         layout->version = 1;
+         BOOST_CHECK_THROW( db.add_index< crate_index >(), std::runtime_error );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( environment_compatibility ) {
+   environment current;
+   environment other_toolchain;
+   strncpy( other_toolchain.compiler, "some other compiler", sizeof(other_toolchain.compiler) - 1 );
+   other_toolchain.boost_version = current.boost_version / 100 * 100 + ( current.boost_version % 100 + 1 ) % 100;
+   other_toolchain.debug = !current.debug;
+   BOOST_TEST( current.is_compatible( other_toolchain ) );
+
+   // another minor version of boost may store the segment manager differently at the same size
+   environment other_boost;
+   other_boost.boost_version = current.boost_version + 100;
+   BOOST_TEST( !current.is_compatible( other_boost ) );
+
+   environment other_layout;
+   other_layout.layout.segment_manager_size += 8;
+   BOOST_TEST( !current.is_compatible( other_layout ) );
+
+   environment legacy = other_toolchain;
+   legacy.layout = segment_layout{ segment_layout::zero_t{} };
+   BOOST_TEST( !current.is_compatible( legacy ) );
+   legacy = current;
+   legacy.layout = segment_layout{ segment_layout::zero_t{} };
+   BOOST_TEST( current.is_compatible( legacy ) );
+
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         db.create< book >( []( book& b ) { b.a = 3; } );
+      }
+      {
+         // rewrite the header as if the database was created by another toolchain
+         std::fstream f( ( temp / "shared_memory.bin" ).string(), std::ios::in | std::ios::out | std::ios::binary );
+         f.seekp( offsetof(db_header, dbenviron) );
+         f.write( reinterpret_cast<const char*>( &other_toolchain ), sizeof(other_toolchain) );
+      }
+      {
+         chainbase::database db(temp, database::read_only);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get< book >( book::id_type(0) ).a == 3 );
+      }
+      {
+         std::fstream f( ( temp / "shared_memory.bin" ).string(), std::ios::in | std::ios::out | std::ios::binary );
+         f.seekp( offsetof(db_header, dbenviron) );
+         f.write( reinterpret_cast<const char*>( &other_layout ), sizeof(other_layout) );
+      }
+      BOOST_CHECK_THROW( chainbase::database(temp, database::read_only), std::system_error );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( check_integrity ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< shelf_index >();
+      for( int i = 0; i < 100; ++i ) {
+         db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.create< shelf >( [&]( shelf& s ) { s.a = i; s.b = i; } );
+      }
+      auto session = db.start_undo_session( true );
+      db.modify( db.get< book >( book::id_type(3) ), []( book& b ) { b.a = 1000; } );
+      db.remove( db.get< shelf >( shelf::id_type(4) ) );
+      BOOST_TEST( db.check_integrity().empty() );
+
+      const_cast<book&>( db.get< book >( book::id_type(5) ) ).b = 50;
+      auto errors = db.check_integrity();
+      BOOST_REQUIRE( errors.size() == 1u );
+      BOOST_TEST( errors[0].find( boost::core::demangle( typeid( book ).name() ) ) == 0u );
+      const_cast<book&>( db.get< book >( book::id_type(5) ) ).b = -5;
+      BOOST_TEST( db.check_integrity().empty() );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( heap_mode_checksums ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const auto checksum_path = temp / "shared_memory.checksums";
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         for( int i = 0; i < 1000; ++i )
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+      }
+      BOOST_REQUIRE( bfs::exists( checksum_path ) );
+      {
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get< book >( book::id_type(999) ).a == 999 );
+      }
+      {
+         std::fstream f( ( temp / "shared_memory.bin" ).string(), std::ios::in | std::ios::out | std::ios::binary );
+         f.seekg( 4096 );
+         char c = 0;
+         f.read( &c, 1 );
+         c ^= 0x20;
+         f.seekp( 4096 );
+         f.write( &c, 1 );
+      }
+      try {
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap);
+         BOOST_FAIL( "expected a checksum mismatch" );
+      } catch( const std::system_error& e ) {
+         BOOST_TEST( ( e.code() == make_error_code( db_error_code::bad_checksum ) ) );
+      }
+      {
+         // the file changes in place in mapped mode, so the checksums are dropped
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped);
+         BOOST_TEST( !bfs::exists( checksum_path ) );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( commit_deferred ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< shelf_index >();
+      for( int i = 0; i < 100; ++i ) {
+         db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.create< shelf >( [&]( shelf& s ) { s.a = i; s.b = i; } );
+      }
+      for( int round = 0; round < 10; ++round ) {
+         auto session = db.start_undo_session( true );
+         for( int i = 0; i < 10; ++i ) {
+            db.modify( db.get< book >( book::id_type(round * 10 + i) ), [&]( book& b ) { b.a += 1000; } );
+            db.remove( db.get< shelf >( shelf::id_type(round * 10 + i) ) );
+         }
+         session.push();
+      }
+      db.commit_deferred( db.revision() - 2 );
+      BOOST_TEST( db.check_integrity().empty() );
+      int calls = 0;
+      while( db.reclaim( 16 ) ) ++calls;
+      BOOST_TEST( calls > 1 );
+      BOOST_TEST( db.check_integrity().empty() );
+      db.undo();
+      db.undo();
+      BOOST_TEST( db.revision() == 8 );
+      BOOST_TEST( db.get< book >( book::id_type(85) ).a == 85 );
+      BOOST_TEST( db.get< book >( book::id_type(75) ).a == 1075 );
+      BOOST_TEST( db.get_index< shelf_index >().indices().size() == 20u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( erase_range ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< shelf_index >();
+      for( int i = 0; i < 100; ++i ) {
+         db.create< shelf >( [&]( shelf& s ) { s.a = i; s.b = 99 - i; } );
+      }
+      {
+         auto session = db.start_undo_session( true );
+         BOOST_TEST( (db.erase_range< shelf, by_b >( 10, 30 )) == 20u );
+         BOOST_TEST( (db.erase_range< shelf, by_b >( 10, 30 )) == 0u );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 80u );
+         BOOST_TEST( (db.find< shelf, by_b >( 10 ) == nullptr) );
+         BOOST_TEST( db.find< shelf >( shelf::id_type(80) ) == nullptr );
+         BOOST_TEST( db.find< shelf >( shelf::id_type(69) ) != nullptr );
+         BOOST_TEST( db.check_integrity().empty() );
+         // the gap left in by_b takes a sorted run
+         db.insert_sorted_run< shelf, by_b >( 20, [&]( shelf& s, std::size_t i ) { s.a = 200 + i; s.b = 10 + i; } );
+         BOOST_CHECK_THROW( (db.insert_sorted_run< shelf, by_b >( 2, [&]( shelf& s, std::size_t i ) { s.a = 300 + i; s.b = 29 + i; } )), std::logic_error );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 100u );
+         BOOST_TEST( (db.get< shelf, by_b >( 10 ).id == shelf::id_type(100)) );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+      BOOST_TEST( db.get_index< shelf_index >().indices().size() == 100u );
+      BOOST_TEST( db.get< shelf >( shelf::id_type(80) ).b == 19 );
+      BOOST_TEST( db.find< shelf >( shelf::id_type(100) ) == nullptr );
+      BOOST_TEST( db.check_integrity().empty() );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( id_table ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const std::string crate_name = boost::core::demangle( typeid( crate ).name() );
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< shelf_index_v1 >();
+         db.get_mutable_index< shelf_index_v1 >().set_id_table( true );
+         for( int i = 0; i < 100; ++i ) {
+            db.get_mutable_index< shelf_index_v1 >().emplace( [&]( shelf& s ) { s.a = i; s.b = 99 - i; } );
+         }
+         auto* segment = db.get_segment_manager();
+         auto* crates = segment->construct< generic_index<crate_index_v1> >( crate_name.c_str() )( generic_index<crate_index_v1>::allocator_type( segment ) );
+         crates->set_id_table( true );
+         for( int i = 0; i < 10; ++i ) {
+            crates->emplace( [&]( crate_v1& c ) { c.weight = i; } );
+         }
+         crates->remove( *crates->find( 3 ) );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         // kept by upgrade_index and migrate_index
+         db.upgrade_index< shelf_index, shelf_index_v1 >();
+         db.migrate_index< crate_index, crate_index_v1 >( []( const crate_v1& old_crate, crate& c ) { c.grams = old_crate.weight; } );
+         BOOST_TEST( db.get_index< shelf_index >().has_id_table() );
+         BOOST_TEST( db.get_index< crate_index >().has_id_table() );
+         BOOST_TEST( db.find< crate >( crate::id_type(3) ) == nullptr );
+         BOOST_TEST( db.get< crate >( crate::id_type(9) ).grams == 9 );
+         BOOST_TEST( db.check_integrity().empty() );
+
+         const int64_t revision = db.revision();
+         {
+            auto session = db.start_undo_session( true );
+            BOOST_TEST( (db.erase_range< shelf, by_b >( 10, 30 )) == 20u );
+            BOOST_TEST( db.find< shelf >( shelf::id_type(80) ) == nullptr );
+            db.create< shelf >( []( shelf& s ) { s.a = 100; s.b = 100; } );
+            session.push();
+         }
+         {
+            auto session = db.start_undo_session( true );
+            db.remove( db.get< shelf >( shelf::id_type(5) ) );
+            db.modify( db.get< shelf >( shelf::id_type(100) ), []( shelf& s ) { s.a = 101; } );
+            BOOST_TEST( (db.find< shelf, by_b >( 100 ) == db.find< shelf >( shelf::id_type(100) )) );
+            BOOST_TEST( db.check_integrity().empty() );
+            session.push();
+         }
+         db.undo_to( revision );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 100u );
+         BOOST_TEST( db.find< shelf >( shelf::id_type(100) ) == nullptr );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(80) ).b == 19 );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(5) ).a == 5 );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< shelf_index >();
+         BOOST_TEST( db.get_index< shelf_index >().has_id_table() );
+         db.set_id_table< shelf >( false );
+         BOOST_TEST( !db.get_index< shelf_index >().has_id_table() );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(99) ).a == 99 );
+         db.set_id_table< shelf >( true );
+         BOOST_TEST( db.create< shelf >( []( shelf& s ) { s.a = 100; s.b = 100; } ).id._id == 100 );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(100) ).b == 100 );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lookup_cache_readers ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< shelf_index >();
+      for( int i = 0; i < 1000; ++i ) {
+         db.create< shelf >( [&]( shelf& s ) { s.a = i; s.b = 1000 - i; } );
+      }
+      db.set_lookup_cache_size< shelf >( 50 );
+      BOOST_TEST( db.get_index< shelf_index >().lookup_cache_size() == 64u );
+      // Readers sharing the database fill the cache concurrently
+      std::atomic<int> mismatches{0};
+      std::vector<std::thread> readers;
+      for( int t = 0; t < 4; ++t ) {
+         readers.emplace_back( [&, t] {
+            for( int round = 0; round < 50; ++round ) {
+               for( int b = 1 + t; b <= 1000; b += 3 ) {
+                  const shelf* s = db.find< shelf, by_b >( b );
+                  if( !s || s->b != b || s->a != 1000 - b ) ++mismatches;
+               }
+            }
+         } );
+      }
+      for( auto& r : readers ) r.join();
+      BOOST_TEST( mismatches.load() == 0 );
+      db.remove( db.get< shelf, by_b >( 500 ) );
+      BOOST_TEST( (db.find< shelf, by_b >( 500 ) == nullptr) );
+      // a cached object that changes its key is found by the new key only
+      BOOST_TEST( (db.get< shelf, by_b >( 400 ).a == 600) );
+      db.modify( db.get< shelf, by_b >( 400 ), []( shelf& s ) { s.b = 2000; } );
+      BOOST_TEST( (db.find< shelf, by_b >( 400 ) == nullptr) );
+      BOOST_TEST( (db.get< shelf, by_b >( 2000 ).a == 600) );
+      db.set_lookup_cache_size< shelf >( 0 );
+      BOOST_TEST( db.get_index< shelf_index >().lookup_cache_size() == 0u );
+      BOOST_TEST( (db.get< shelf, by_b >( 2000 ).a == 600) );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( speculation ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         for( int i = 0; i < 10; ++i ) {
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = i; } );
+         }
+         auto session = db.start_undo_session( true );
+         db.modify( db.get< book >( book::id_type(0) ), []( book& b ) { b.a = 100; } );
+         session.push();
+
+         db.start_speculation();
+         BOOST_CHECK_THROW( db.start_speculation(), std::system_error );
+         db.modify( db.get< book >( book::id_type(1) ), []( book& b ) { b.a = 101; } );
+         for( int i = 0; i < 1000; ++i ) {
+            db.create< book >( [&]( book& b ) { b.a = 1000 + i; b.b = 1000 + i; } );
+         }
+         db.commit( db.revision() );
+         db.add_index< shelf_index >();
+         db.create< shelf >( []( shelf& s ) { s.a = 1; s.b = 1; } );
+         db.discard_speculation();
+         BOOST_TEST( !db.is_speculating() );
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 10u );
+         BOOST_TEST( db.get< book >( book::id_type(1) ).a == 1 );
+         BOOST_TEST( db.revision() == 1 );
+         BOOST_TEST( db.check_integrity().empty() );
+         db.undo();
+         BOOST_TEST( db.get< book >( book::id_type(0) ).a == 0 );
+
+         db.start_speculation();
+         db.add_index< shelf_index >();
+         db.create< shelf >( []( shelf& s ) { s.a = 1; s.b = 1; } );
+         for( int i = 0; i < 1000; ++i ) {
+            db.create< book >( [&]( book& b ) { b.a = 1000 + i; b.b = 1000 + i; } );
+         }
+         db.commit_speculation();
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1010u );
+         db.create< book >( []( book& b ) { b.a = -1; b.b = -1; } );
+
+         // undo states of sessions started while speculating are discarded with it
+         db.start_speculation();
+         {
+            auto speculative = db.start_undo_session( true );
+            db.create< book >( []( book& b ) { b.a = -2; b.b = -2; } );
+            BOOST_CHECK_THROW( db.discard_speculation(), std::logic_error );
+            BOOST_TEST( db.is_speculating() );
+            BOOST_TEST( db.revision() == 1 );
+            speculative.undo();
+         }
+         db.discard_speculation();
+         BOOST_TEST( db.revision() == 0 );
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1011u );
+         db.start_speculation();
+         {
+            auto pushed = db.start_undo_session( true );
+            db.create< book >( []( book& b ) { b.a = -2; b.b = -2; } );
+            pushed.push();
+         }
+         db.discard_speculation();
+         BOOST_TEST( db.revision() == 0 );
+         // committing keeps them, so they can still be undone
+         db.start_speculation();
+         {
+            auto committed = db.start_undo_session( true );
+            db.create< book >( []( book& b ) { b.a = -2; b.b = -2; } );
+            db.commit_speculation();
+            db.start_speculation();
+            db.discard_speculation();
+         }
+         BOOST_TEST( db.revision() == 0 );
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1011u );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         db.add_index< shelf_index >();
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1011u );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 1u );
+         BOOST_TEST( db.check_integrity().empty() );
+         db.start_speculation();
+         db.remove( db.get< shelf >( shelf::id_type(0) ) );
+         // destroyed while speculating
+      }
+      {
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< shelf_index >();
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 1u );
+         try {
+            db.start_speculation();
+            BOOST_FAIL( "expected speculation to be refused in heap mode" );
+         } catch( const std::system_error& e ) {
+            BOOST_TEST( ( e.code() == make_error_code( db_error_code::no_speculation ) ) );
+         }
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE( speculation_write_back_failure ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   // writes past the first page of the file fail while the limit is lowered
+   rlimit unlimited;
+   getrlimit( RLIMIT_FSIZE, &unlimited );
+   auto commit_past_limit = [&]( database& db ) {
+      rlimit limited = unlimited;
+      limited.rlim_cur = sysconf( _SC_PAGESIZE );
+      auto old_handler = signal( SIGXFSZ, SIG_IGN );
+      setrlimit( RLIMIT_FSIZE, &limited );
+      BOOST_CHECK_THROW( db.commit_speculation(), std::system_error );
+      setrlimit( RLIMIT_FSIZE, &unlimited );
+      signal( SIGXFSZ, old_handler );
+   };
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         db.start_speculation();
+         for( int i = 0; i < 1000; ++i ) {
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = i; } );
+         }
+         commit_past_limit( db );
+         // the file holds part of the speculation, so there is nothing left to discard to
+         BOOST_TEST( db.is_speculating() );
+         BOOST_CHECK_THROW( db.discard_speculation(), std::logic_error );
+         db.commit_speculation();
+         BOOST_TEST( !db.is_speculating() );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1000u );
+         BOOST_TEST( db.check_integrity().empty() );
+         db.start_speculation();
+         for( int i = 1000; i < 2000; ++i ) {
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = i; } );
+         }
+         commit_past_limit( db );
+         // destroyed after a failed write back, which must not mark the file clean
+      }
+      try {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         BOOST_FAIL( "expected the database to be left dirty" );
+      } catch( const std::system_error& e ) {
+         BOOST_TEST( ( e.code() == make_error_code( db_error_code::dirty ) ) );
+      }
+   } catch ( ... ) {
+      setrlimit( RLIMIT_FSIZE, &unlimited );
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( segments ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         BOOST_CHECK_THROW( db.add_index< shelf_index >( "cold" ), std::logic_error );
+         db.add_segment( "cold", 1024*1024*8 );
+         BOOST_CHECK_THROW( db.add_segment( "cold", 1024*1024*8 ), std::logic_error );
+         BOOST_CHECK_THROW( db.add_segment( "shared_memory", 1024*1024*8 ), std::logic_error );
+         db.add_index< book_index >();
+         db.add_index< shelf_index >( "cold" );
+         BOOST_TEST( db.get_segment_manager( "cold" ) != db.get_segment_manager() );
+         BOOST_TEST( db.get_segment_manager( "cold" )->find< shelf_index >( "shelf" ).first != nullptr );
+         BOOST_TEST( db.get_segment_manager()->find< shelf_index >( "shelf" ).first == nullptr );
+
+         db.create< book >( []( book& b ) { b.a = 1; b.b = 1; } );
+         db.create< shelf >( []( shelf& s ) { s.a = 1; s.b = 1; } );
+         {
+            // sessions span both segments
+            auto session = db.start_undo_session( true );
+            db.create< book >( []( book& b ) { b.a = 2; b.b = 2; } );
+            db.modify( db.get< shelf >( shelf::id_type(0) ), []( shelf& s ) { s.a = 10; } );
+         }
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1u );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(0) ).a == 1 );
+
+         auto session = db.start_undo_session( true );
+         db.create< shelf >( []( shelf& s ) { s.a = 2; s.b = 2; } );
+         session.push();
+         db.start_speculation();
+         db.create< shelf >( []( shelf& s ) { s.a = 3; s.b = 3; } );
+         db.discard_speculation();
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 2u );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         // the segment must be opened again before its indices are added
+         BOOST_CHECK_THROW( db.add_index< shelf_index >( "cold" ), std::logic_error );
+         db.add_segment( "cold", 1024*1024*8, pinnable_mapped_file::map_mode::heap );
+         db.add_index< shelf_index >( "cold" );
+         BOOST_TEST( db.revision() == 1 );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 2u );
+         BOOST_CHECK_THROW( db.start_speculation(), std::system_error );
+         BOOST_TEST( !db.is_speculating() );
+         db.undo();
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 1u );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+      {
+         chainbase::database db(temp, database::read_only);
+         db.add_segment( "cold", 0 );
+         db.add_index< book_index >();
+         db.add_index< shelf_index >( "cold" );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 1u );
+         BOOST_CHECK_THROW( db.add_segment( "missing", 0 ), std::system_error );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( upgrade_index_in_segment ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const std::string crate_name = boost::core::demangle( typeid( crate ).name() );
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_segment( "cold", 1024*1024*8 );
+         db.add_index< shelf_index_v1 >( "cold" );
+         auto& idx = db.get_mutable_index< shelf_index_v1 >();
+         for( int i = 0; i < 50; ++i ) {
+            idx.emplace( [&]( shelf& s ) { s.a = i; s.b = 49 - i; } );
+         }
+         auto* segment = db.get_segment_manager( "cold" );
+         auto* crates = segment->construct< generic_index<crate_index_v1> >( crate_name.c_str() )( generic_index<crate_index_v1>::allocator_type( segment ) );
+         for( int i = 0; i < 20; ++i ) {
+            crates->emplace( [&]( crate_v1& c ) { c.weight = i; } );
+         }
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_segment( "cold", 1024*1024*8 );
+         // the table is upgraded in the segment that it is placed in
+         db.set_index_placement( { { "shelf", "cold" } } );
+         db.upgrade_index< shelf_index, shelf_index_v1 >();
+         BOOST_TEST( db.get_segment_manager()->find< char >( "shelf" ).first == nullptr );
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 50u );
+         BOOST_TEST( (db.get_index< shelf_index, by_b >().begin()->a == 49) );
+         BOOST_TEST( (db.find< shelf, by_b >( 0 ) == &db.get< shelf >( shelf::id_type(49) )) );
+
+         db.migrate_index< crate_index, crate_index_v1 >( "cold", []( const crate_v1& old_crate, crate& c ) {
+            c.grams = int64_t( old_crate.weight ) * 1000;
+         } );
+         BOOST_TEST( db.get_segment_manager()->find< char >( crate_name.c_str() ).first == nullptr );
+         BOOST_TEST( db.get_index< crate_index >().indices().size() == 20u );
+         BOOST_TEST( db.get< crate >( crate::id_type(19) ).grams == 19000 );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_segment( "cold", 1024*1024*8 );
+         db.upgrade_index< shelf_index, shelf_index_v1 >( "cold" ); /// already upgraded
+         db.migrate_index< crate_index, crate_index_v1 >( "cold", []( const crate_v1&, crate& ) {} ); /// already migrated
+         BOOST_TEST( db.get_index< shelf_index >().indices().size() == 50u );
+         BOOST_TEST( db.get< crate >( crate::id_type(0) ).grams == 0 );
+         BOOST_TEST( db.get< crate >( crate::id_type(1) ).grams == 1000 );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( index_placement ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      std::map<std::string, std::string> placement;
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         db.add_index< shelf_index >();
+         db.find< book >( book::id_type(0) );
+         BOOST_TEST( db.index_access_counts()[0].reads == 0u ); // counting is off by default
+         db.set_access_counting( true );
+         for( int i = 0; i < 100; ++i ) {
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = i; } );
+         }
+         db.create< shelf >( []( shelf& s ) { s.a = 1; s.b = 1; } );
+         for( int i = 0; i < 1000; ++i ) {
+            BOOST_TEST( db.find< shelf >( shelf::id_type(0) ) != nullptr );
+         }
+         db.get< book >( book::id_type(10) );
+
+         auto accesses = db.index_access_counts();
+         BOOST_TEST_REQUIRE( accesses.size() == 2u );
+         BOOST_TEST( accesses[0].type_name == "book" );
+         BOOST_TEST( accesses[0].segment == "" );
+         BOOST_TEST( accesses[0].writes == 100u );
+         BOOST_TEST( accesses[0].reads == 1u );
+         BOOST_TEST( accesses[0].size >= 100u * sizeof( book ) );
+         BOOST_TEST( accesses[1].reads == 1000u );
+         BOOST_TEST( accesses[1].writes == 1u );
+
+         // shelf is accessed more and is smaller, so it fits in the budget
+         placement = database::tiered_index_placement( accesses, accesses[1].size, "", "cold" );
+         BOOST_TEST( placement["shelf"] == "" );
+         BOOST_TEST( placement["book"] == "cold" );
+      }
+      bfs::remove_all( temp );
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+         db.add_segment( "cold", 1024*1024*8, pinnable_mapped_file::map_mode::mapped );
+         db.set_index_placement( placement );
+         db.add_index< book_index >();
+         db.add_index< shelf_index >();
+         BOOST_TEST( db.get_segment_manager( "cold" )->find< book_index >( "book" ).first != nullptr );
+         BOOST_TEST( db.get_segment_manager()->find< shelf_index >( "shelf" ).first != nullptr );
+         BOOST_TEST( db.index_access_counts()[0].segment == "cold" );
+         db.create< book >( []( book& b ) { b.a = 1; b.b = 1; } );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_segment( "cold", 1024*1024*8 );
+         // a stored table is not moved to another segment
+         BOOST_CHECK_THROW( db.add_index< book_index >(), std::logic_error );
+         db.set_index_placement( placement );
+         db.add_index< book_index >();
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 1u );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lazy_mode ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const auto lazy = pinnable_mapped_file::map_mode::lazy;
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*32, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         for( int i = 0; i < 10000; ++i )
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+      }
+      {
+         // usable before the file is loaded
+         chainbase::database db(temp, database::read_write, 0, false, lazy);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get< book >( book::id_type(9999) ).a == 9999 );
+         db.modify( db.get< book >( book::id_type(5000) ), []( book& b ) { b.a = -1; } );
+         db.create< book >( []( book& b ) { b.a = 10000; b.b = -10000; } );
+         db.wait_for_load();
+         BOOST_TEST( db.get_index< book_index >().indices().size() == 10001u );
+         BOOST_TEST( db.check_integrity().empty() );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, lazy);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get< book >( book::id_type(5000) ).a == -1 );
+         BOOST_TEST( db.get< book >( book::id_type(10000) ).b == -10000 );
+         db.wait_for_load();
+      }
+      auto flip_byte = [&]( std::streamoff offset ) {
+         std::fstream f( ( temp / "shared_memory.bin" ).string(), std::ios::in | std::ios::out | std::ios::binary );
+         f.seekg( offset );
+         char c = 0;
+         f.read( &c, 1 );
+         c ^= 0x20;
+         f.seekp( offset );
+         f.write( &c, 1 );
+      };
+      auto expect_bad_checksum = [&]( bool wait, database::open_flags flags = database::read_only ) {
+         try {
+            chainbase::database db(temp, flags, 0, false, lazy);
+            if( wait ) db.wait_for_load();
+            BOOST_FAIL( "expected a checksum mismatch" );
+         } catch( const std::system_error& e ) {
+            BOOST_TEST( ( e.code() == make_error_code( db_error_code::bad_checksum ) ) );
+         }
+      };
+      // the chunk of the segment manager is checked when opening
+      flip_byte( 4096 );
+      expect_bad_checksum( false );
+      // a writable open that fails the check leaves the database clean
+      expect_bad_checksum( false, database::read_write );
+      flip_byte( 4096 );
+      {
+         chainbase::database db(temp, database::read_only, 0, false, lazy);
+         db.wait_for_load();
+      }
+      {
+         // other chunks are checked as they are loaded, and reported once loaded, or when opening if the
+         // file cannot be loaded lazily here
+         std::ifstream f( ( temp / "shared_memory.bin" ).string(), std::ios::binary );
+         f.seekg( 1024*1024 );
+         std::streamoff offset = 1024*1024;
+         char c = 0;
+         while( f.get( c ) && c == 0 ) ++offset;
+         BOOST_REQUIRE( f );
+         f.close();
+         flip_byte( offset );
+      }
+      expect_bad_checksum( true );
+      {
+         std::stringstream ss( "lazy" );
+         pinnable_mapped_file::map_mode mode = pinnable_mapped_file::map_mode::mapped;
+         ss >> mode;
+         BOOST_TEST( ( mode == lazy ) );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( hot_chunks ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const auto hot_path = temp / "shared_memory.hot";
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*32, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         for( int i = 0; i < 10000; ++i )
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+      }
+      {
+         std::ofstream( hot_path.string() ) << "not a record of hot chunks";
+      }
+      for( int i = 0; i < 3; ++i ) {
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::lazy);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get< book >( book::id_type(9999 - i) ).a == 9999 - i );
+         db.modify( db.get< book >( book::id_type(i) ), [&]( book& b ) { b.b = i; } );
+         db.wait_for_load();
+         BOOST_TEST( db.check_integrity().empty() );
+         // a header and one bit for each of the 32 chunks, if any chunk was accessed before it was loaded
+         BOOST_TEST( ( !bfs::exists( hot_path ) || bfs::file_size( hot_path ) == 24u + 4u || i == 0 ) );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped);
+         db.add_index< book_index >();
+         for( int i = 0; i < 3; ++i )
+            BOOST_TEST( db.get< book >( book::id_type(i) ).b == i );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( clone_database_directory ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   boost::filesystem::path copy = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      BOOST_CHECK_THROW( clone_database( temp, copy ), std::system_error );
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*64);
+         db.add_segment( "cold", 1024*1024*8 );
+         db.add_index< book_index >();
+         db.add_index< shelf_index >( "cold" );
+         for( int i = 0; i < 1000; ++i )
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.create< shelf >( []( shelf& s ) { s.a = 1; s.b = 1; } );
+         try {
+            clone_database( temp, copy );
+            BOOST_FAIL( "expected a database open for writing to be refused" );
+         } catch( const std::system_error& e ) {
+            BOOST_TEST( ( e.code() == make_error_code( db_error_code::dirty ) ) );
+         }
+      }
+      clone_database( temp, copy );
+      BOOST_TEST( bfs::file_size( copy / "shared_memory.bin" ) == bfs::file_size( temp / "shared_memory.bin" ) );
+      BOOST_CHECK_THROW( clone_database( temp, copy ), std::system_error );
+      {
+         chainbase::database db(copy, database::read_write);
+         db.add_segment( "cold", 0 );
+         db.add_index< book_index >();
+         db.add_index< shelf_index >( "cold" );
+         BOOST_TEST( db.get< book >( book::id_type(999) ).b == -999 );
+         BOOST_TEST( db.get< shelf >( shelf::id_type(0) ).a == 1 );
+         db.modify( db.get< book >( book::id_type(0) ), []( book& b ) { b.a = -1; } );
+      }
+      {
+         chainbase::database db(temp, database::read_only);
+         db.add_index< book_index >();
+         BOOST_TEST( db.get< book >( book::id_type(0) ).a == 0 );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      bfs::remove_all( copy );
+      throw;
+   }
+   bfs::remove_all( temp );
+   bfs::remove_all( copy );
+}
+
+BOOST_AUTO_TEST_CASE( immutable_open ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   const auto data_path = temp / "shared_memory.bin";
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         for( int i = 0; i < 1000; ++i )
+            db.create< book >( [&]( book& b ) { b.a = i; b.b = -i; } );
+      }
+      const auto write_time = bfs::last_write_time( data_path );
+      {
+         chainbase::database db1(temp, database::immutable, 0, false, pinnable_mapped_file::map_mode::heap);
+         chainbase::database db2(temp, database::immutable, 0, false, pinnable_mapped_file::map_mode::locked);
+         chainbase::database db3(temp, database::immutable, 0, false, pinnable_mapped_file::map_mode::lazy);
+         for( auto* db : { &db1, &db2, &db3 } ) {
+            BOOST_TEST( db->is_read_only() );
+            db->add_index< book_index >();
+            BOOST_TEST( db->get< book >( book::id_type(999) ).b == -999 );
+         }
+         // in mapped mode pages are read as they are used
+         chainbase::database db4(temp, database::immutable, 0, false, pinnable_mapped_file::map_mode::mapped);
+         db4.add_index< book_index >();
+         BOOST_TEST( db4.get_index< book_index >().indices().size() == 1000u );
+      }
+      BOOST_TEST( ( bfs::last_write_time( data_path ) == write_time ) );
+      {
+         std::fstream f( data_path.string(), std::ios::in | std::ios::out | std::ios::binary );
+         f.seekp( 4096 );
+         f.put( 0x55 );
+      }
+      try {
+         chainbase::database db(temp, database::immutable, 0, false, pinnable_mapped_file::map_mode::heap);
+         BOOST_FAIL( "expected a checksum mismatch" );
+      } catch( const std::system_error& e ) {
+         BOOST_TEST( ( e.code() == make_error_code( db_error_code::bad_checksum ) ) );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( memory_backing ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         BOOST_TEST( db.memory_backing().empty() );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap);
+         BOOST_TEST_REQUIRE( db.memory_backing().size() == 1u );
+         BOOST_TEST( db.memory_backing()[0].page_size == bip::mapped_region::get_page_size() );
+         BOOST_TEST( db.memory_backing()[0].size == 1024u*1024*8 );
+      }
+      // hugepage paths are checked in heap mode too, rather than refused
+      BOOST_CHECK_THROW( chainbase::database(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::heap, { temp.string() }),
+                         std::runtime_error );
+      try {
+         chainbase::database db(temp, database::read_write, 0, false, pinnable_mapped_file::map_mode::mapped, { temp.string() });
+         BOOST_FAIL( "expected hugepage paths to be refused in mapped mode" );
+      } catch( const std::system_error& e ) {
+         BOOST_TEST( ( e.code() == make_error_code( db_error_code::locked_mode_required ) ) );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
 // BOOST_AUTO_TEST_SUITE_END()
@@ -2,10 +2,12 @@
 
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/ranked_index.hpp>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/test/data/monomorphic.hpp>
 #include <boost/test/data/test_case.hpp>
+#include <random>
 
 
 namespace {
@@ -595,6 +597,22 @@ EXCEPTION_TEST_CASE(test_modify_fail) {
 
 struct by_secondary {};
 
+BOOST_AUTO_TEST_CASE(test_modify_after_failed_modify) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   const auto& elem0 = i0.emplace([](test_element_t& elem) { elem.secondary = 1; });
+   i0.emplace([](test_element_t& elem) { elem.secondary = 2; });
+   {
+      auto session = i0.start_undo_session(true);
+      BOOST_CHECK_THROW(i0.modify(elem0, [](test_element_t& elem) { elem.secondary = 2; }), std::logic_error);
+      i0.modify(elem0, [](test_element_t& elem) { elem.secondary = 3; });
+   }
+   BOOST_TEST(elem0.secondary == 1);
+   BOOST_TEST(i0.get<by_secondary>().find(1)->id == 0u);
+   BOOST_TEST(i0.get<by_secondary>().find(3) == i0.get<by_secondary>().end());
+}
+
 BOOST_AUTO_TEST_CASE(test_project) {
    chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
                          boost::multi_index::ordered_unique<key<&test_element_t::id>>,
@@ -606,6 +624,754 @@ BOOST_AUTO_TEST_CASE(test_project) {
    BOOST_TEST(i0.project<1>(i0.end()) == i0.get<by_secondary>().end());
 }
 
+BOOST_AUTO_TEST_CASE(test_find_many) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 100; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i * 2; });
+   }
+   std::vector<uint64_t> ids;
+   for(uint64_t i = 0; i < 120; i += 3) ids.push_back(119 - i);
+   std::vector<const test_element_t*> by_id;
+   i0.find_many(ids.begin(), ids.end(), std::back_inserter(by_id));
+   BOOST_TEST(by_id.size() == ids.size());
+   for(std::size_t i = 0; i < ids.size(); ++i) {
+      BOOST_TEST(by_id[i] == i0.find(ids[i]));
+   }
+   std::vector<int> secondaries = { 7, 0, 198, 199, 42, -1, 42 };
+   std::vector<const test_element_t*> by_sec;
+   i0.get<by_secondary>().find_many(secondaries.begin(), secondaries.end(), std::back_inserter(by_sec));
+   BOOST_TEST(by_sec.size() == secondaries.size());
+   for(std::size_t i = 0; i < secondaries.size(); ++i) {
+      auto iter = i0.get<by_secondary>().find(secondaries[i]);
+      BOOST_TEST(by_sec[i] == (iter == i0.get<by_secondary>().end() ? nullptr : &*iter));
+   }
+}
+
+struct by_id {};
+
+EXCEPTION_TEST_CASE(test_lookup_cache) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<boost::multi_index::tag<by_id>, key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   i0.set_lookup_cache_size(10);
+   BOOST_TEST(i0.lookup_cache_size() == 16u);
+   for(int i = 0; i < 8; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   auto check = [&] {
+      for(int i = -2; i < 12; ++i) {
+         auto iter = i0.get<by_secondary>().find(i);
+         const test_element_t* expected = iter == i0.get<by_secondary>().end() ? nullptr : &*iter;
+         BOOST_TEST(i0.find<by_secondary>(i) == expected);
+         BOOST_TEST(i0.find<by_secondary>(i) == expected);
+         BOOST_TEST(i0.find<by_id>(uint64_t(i)) == i0.find(uint64_t(i)));
+      }
+   };
+   check();
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(*i0.find<by_secondary>(3), [](test_element_t& elem) { elem.secondary = 10; });
+      check();
+      i0.remove(*i0.find<by_secondary>(5));
+      check();
+      i0.emplace([](test_element_t& elem) { elem.secondary = 5; });
+      check();
+   }
+   check();
+   BOOST_TEST(i0.find<by_secondary>(3)->id == 3u);
+   i0.set_lookup_cache_size(0);
+   BOOST_TEST(i0.lookup_cache_size() == 0u);
+   check();
+}
+
+EXCEPTION_TEST_CASE(test_id_table) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 4; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   i0.remove(*i0.find(1));
+   i0.set_id_table(true);
+   BOOST_TEST(i0.has_id_table());
+   auto check = [&] {
+      for(int i = -1; i < 10; ++i) {
+         auto iter = i0.get<0>().find(uint64_t(i));
+         BOOST_TEST(i0.find(i) == (iter == i0.get<0>().end() ? nullptr : &*iter));
+      }
+   };
+   check();
+   {
+      auto session = i0.start_undo_session(true);
+      i0.emplace([](test_element_t& elem) { elem.secondary = 10; });
+      i0.remove(*i0.find(2));
+      i0.remove(*i0.find(4));
+      check();
+      BOOST_CHECK_THROW(i0.emplace([](test_element_t& elem) { elem.secondary = 3; }), std::logic_error);
+      i0.emplace([](test_element_t& elem) { elem.secondary = 11; });
+      check();
+   }
+   check();
+   BOOST_TEST(i0.find(2)->secondary == 2);
+   BOOST_TEST(i0.find(5) == nullptr);
+   i0.emplace([](test_element_t& elem) { elem.secondary = 12; });
+   BOOST_TEST(i0.find(4)->secondary == 12);
+   check();
+   i0.set_id_table(false);
+   check();
+}
+
+
+BOOST_AUTO_TEST_CASE(test_ranked) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ranked_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ranked_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   auto check = [&] {
+      const auto& by_id = i0.get<0>();
+      const auto& by_sec = i0.get<by_secondary>();
+      std::size_t n = 0;
+      for(auto iter = by_sec.begin(); iter != by_sec.end(); ++iter, ++n) {
+         BOOST_TEST(by_sec.rank(iter) == n);
+         BOOST_TEST((by_sec.nth(n) == iter));
+      }
+      BOOST_TEST(n == i0.size());
+      BOOST_TEST(by_sec.rank(by_sec.end()) == n);
+      BOOST_TEST((by_sec.nth(n) == by_sec.end()));
+      n = 0;
+      for(auto iter = by_id.begin(); iter != by_id.end(); ++iter, ++n) {
+         BOOST_TEST(by_id.rank(iter) == n);
+         BOOST_TEST((by_id.nth(n) == iter));
+      }
+      for(int k = -5; k < 105; k += 7) {
+         BOOST_TEST(by_sec.lower_bound_rank(k) == static_cast<std::size_t>(std::distance(by_sec.begin(), by_sec.lower_bound(k))));
+         BOOST_TEST(by_sec.upper_bound_rank(k) == static_cast<std::size_t>(std::distance(by_sec.begin(), by_sec.upper_bound(k))));
+      }
+   };
+   std::mt19937 rng(42);
+   auto random_secondary = [&] { return static_cast<int>(rng() % 100); };
+   for(int i = 0; i < 50; ++i) {
+      try { i0.emplace([&](test_element_t& elem) { elem.secondary = random_secondary(); }); } catch(std::logic_error&) {}
+      i0.verify();
+   }
+   check();
+   for(int round = 0; round < 10; ++round) {
+      auto session = i0.start_undo_session(true);
+      for(int i = 0; i < 30; ++i) {
+         switch(rng() % 3) {
+          case 0:
+            try { i0.emplace([&](test_element_t& elem) { elem.secondary = random_secondary(); }); } catch(std::logic_error&) {}
+            break;
+          case 1:
+            if(!i0.empty()) {
+               const auto& obj = *i0.get<0>().nth(rng() % i0.size());
+               try { i0.modify(obj, [&](test_element_t& elem) { elem.secondary = random_secondary(); }); } catch(std::logic_error&) {}
+            }
+            break;
+          case 2:
+            if(!i0.empty()) i0.remove(*i0.get<by_secondary>().nth(rng() % i0.size()));
+            break;
+         }
+         // checks every size and aggregate, so a wrong one fails here rather than in a later query
+         i0.verify();
+      }
+      check();
+      if(round % 2) session.push();
+      else session.undo();
+      i0.verify();
+   }
+   check();
+}
+
+BOOST_AUTO_TEST_CASE(test_aggregated) {
+   using secondary_key = key<&test_element_t::secondary>;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, key<&test_element_t::id>>,
+                         chainbase::aggregated_unique<chainbase::max_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>> i0;
+   auto check = [&] {
+      const auto& by_id = i0.get<0>();
+      const auto& by_sec = i0.get<by_secondary>();
+      int total = 0;
+      for(const auto& elem : i0) total += elem.secondary;
+      BOOST_TEST(by_id.aggregate() == total);
+      for(uint64_t lo = 0; lo < 70; lo += 9) {
+         for(uint64_t hi = lo; hi < 80; hi += 13) {
+            int expected = 0;
+            for(auto iter = by_id.lower_bound(lo); iter != by_id.lower_bound(hi); ++iter) expected += iter->secondary;
+            BOOST_TEST(by_id.aggregate(by_id.lower_bound(lo), by_id.lower_bound(hi)) == expected);
+         }
+      }
+      for(int lo = -5; lo < 100; lo += 11) {
+         for(int hi = lo; hi < 110; hi += 7) {
+            int expected = std::numeric_limits<int>::lowest();
+            for(auto iter = by_sec.lower_bound(lo); iter != by_sec.lower_bound(hi); ++iter) expected = iter->secondary;
+            BOOST_TEST(by_sec.aggregate(by_sec.lower_bound(lo), by_sec.lower_bound(hi)) == expected);
+         }
+      }
+   };
+   std::mt19937 rng(7);
+   auto random_secondary = [&] { return static_cast<int>(rng() % 100); };
+   for(int i = 0; i < 40; ++i) {
+      try { i0.emplace([&](test_element_t& elem) { elem.secondary = random_secondary(); }); } catch(std::logic_error&) {}
+      i0.verify();
+   }
+   check();
+   for(int round = 0; round < 8; ++round) {
+      auto session = i0.start_undo_session(true);
+      for(int i = 0; i < 20; ++i) {
+         switch(rng() % 3) {
+          case 0:
+            try { i0.emplace([&](test_element_t& elem) { elem.secondary = random_secondary(); }); } catch(std::logic_error&) {}
+            break;
+          case 1:
+            if(!i0.empty()) {
+               const auto& obj = *i0.get<0>().nth(rng() % i0.size());
+               try { i0.modify(obj, [&](test_element_t& elem) { elem.secondary = random_secondary(); }); } catch(std::logic_error&) {}
+            }
+            break;
+          case 2:
+            if(!i0.empty()) i0.remove(*i0.get<0>().nth(rng() % i0.size()));
+            break;
+         }
+         // checks every size and aggregate, so a wrong one fails here rather than in a later query
+         i0.verify();
+      }
+      check();
+      if(round % 2) session.push();
+      else session.undo();
+      i0.verify();
+   }
+   check();
+}
+
+EXCEPTION_TEST_CASE(test_build_from) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>> i0;
+   for(int i = 0; i < 20; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = (i * 7) % 20; });
+   }
+   i0.remove(*i0.find(3));
+   {
+      chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i1;
+      auto session = i0.start_undo_session(true);
+      BOOST_CHECK_THROW(i1.build_from(i0), std::logic_error);
+   }
+   i0.modify(*i0.find(5), [](test_element_t& elem) { elem.secondary = 7; });
+   {
+      chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                            boost::multi_index::ranked_unique<key<&test_element_t::secondary>>> i1;
+      BOOST_CHECK_THROW(i1.build_from(i0), std::logic_error); // secondary 7 is not unique
+      BOOST_TEST(i0.size() == 19u);
+      BOOST_TEST(i1.empty());
+   }
+   i0.modify(*i0.find(5), [](test_element_t& elem) { elem.secondary = 35; });
+   {
+      chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                            boost::multi_index::ranked_unique<key<&test_element_t::secondary>>> i1;
+      i1.copy_from(i0);
+      BOOST_TEST(i0.size() == 19u);
+      BOOST_TEST(i1.size() == 19u);
+      BOOST_TEST(i1.get<1>().nth(18)->secondary == 35);
+      BOOST_TEST(i1.emplace([](test_element_t& elem) { elem.secondary = 100; }).id == 20u);
+   }
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ranked_unique<key<&test_element_t::secondary>>> i1;
+   i1.build_from(i0);
+   BOOST_TEST(i0.empty());
+   BOOST_TEST(i1.size() == 19u);
+   BOOST_TEST(i1.find(3) == nullptr);
+   int prev = -1;
+   std::size_t n = 0;
+   for(const auto& elem : i1.get<1>()) {
+      BOOST_TEST(elem.secondary > prev);
+      BOOST_TEST(elem.secondary == (elem.id == 5 ? 35 : static_cast<int>(elem.id * 7) % 20));
+      BOOST_TEST(i1.get<1>().rank(i1.get<1>().iterator_to(elem)) == n++);
+      prev = elem.secondary;
+   }
+   BOOST_TEST(i1.emplace([](test_element_t& elem) { elem.secondary = 100; }).id == 20u);
+   i1.remove(*i1.find(0));
+   BOOST_TEST(i1.get<1>().nth(0)->secondary == 2);
+}
+
+struct converted_element_t {
+   template<typename C, typename A>
+   converted_element_t(C&& c, const std::allocator<A>&) { c(*this); }
+   uint64_t id;
+   int64_t secondary;
+   int twice;
+   throwing_copy dummy;
+};
+
+EXCEPTION_TEST_CASE(test_convert_from) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>> i0;
+   for(int i = 0; i < 20; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = (i * 7) % 20; });
+   }
+   i0.remove(*i0.find(3));
+   i0.remove(*i0.find(19));
+   {
+      chainbase::undo_index<converted_element_t, test_allocator<converted_element_t>,
+                            boost::multi_index::ordered_unique<key<&converted_element_t::id>>,
+                            boost::multi_index::ordered_unique<key<&converted_element_t::twice>>> i1;
+      auto convert = [](const test_element_t& old_elem, converted_element_t& elem) {
+         elem.secondary = old_elem.secondary;
+         elem.twice = old_elem.secondary / 2; // not unique
+      };
+      BOOST_CHECK_THROW(i1.convert_from(i0, convert), std::logic_error);
+      BOOST_TEST(i1.empty());
+   }
+   chainbase::undo_index<converted_element_t, test_allocator<converted_element_t>,
+                         boost::multi_index::ordered_unique<key<&converted_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&converted_element_t::twice>>> i1;
+   i1.convert_from(i0, [](const test_element_t& old_elem, converted_element_t& elem) {
+      elem.secondary = old_elem.secondary;
+      elem.twice = old_elem.secondary * 2;
+   });
+   BOOST_TEST(i0.size() == 18u);
+   BOOST_TEST(i1.size() == 18u);
+   BOOST_TEST(i1.find(3) == nullptr);
+   int prev = -1;
+   for(const auto& elem : i1.get<1>()) {
+      BOOST_TEST(elem.twice > prev);
+      BOOST_TEST(elem.secondary == static_cast<int64_t>(elem.id * 7) % 20);
+      BOOST_TEST(elem.twice == elem.secondary * 2);
+      prev = elem.twice;
+   }
+   BOOST_TEST(i1.emplace([](converted_element_t& elem) { elem.twice = 100; }).id == 20u);
+}
+
+BOOST_AUTO_TEST_CASE(test_commit_deferred) {
+   using index_type = chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::secondary>>>;
+   index_type eager, deferred;
+   auto contents = [](const index_type& idx) {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : idx) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   std::mt19937 rng(11);
+   int next_secondary = 0;
+   std::vector<index_type::session> eager_sessions, deferred_sessions;
+   for(int round = 0; round < 30; ++round) {
+      eager_sessions.push_back(eager.start_undo_session(true));
+      deferred_sessions.push_back(deferred.start_undo_session(true));
+      for(int i = 0; i < 20; ++i) {
+         auto op = rng() % 3;
+         if(op == 0 || eager.empty()) {
+            int secondary = next_secondary++;
+            eager.emplace([&](test_element_t& elem) { elem.secondary = secondary; });
+            deferred.emplace([&](test_element_t& elem) { elem.secondary = secondary; });
+         } else {
+            uint64_t id = eager.begin()->id + rng() % (eager.size() + 5);
+            const test_element_t* e = eager.find(id);
+            if(!e) continue;
+            const test_element_t* d = deferred.find(id);
+            if(op == 1) {
+               int secondary = next_secondary++;
+               eager.modify(*e, [&](test_element_t& elem) { elem.secondary = secondary; });
+               deferred.modify(*d, [&](test_element_t& elem) { elem.secondary = secondary; });
+            } else {
+               eager.remove(*e);
+               deferred.remove(*d);
+            }
+         }
+      }
+      if(round % 7 == 6) {
+         eager.commit(eager.revision() - 3);
+         deferred.commit_deferred(deferred.revision() - 3);
+         BOOST_TEST((deferred.undo_stack_revision_range() == eager.undo_stack_revision_range()));
+         deferred.verify();
+      }
+      if(round % 5 == 4) {
+         deferred.reclaim(4);
+         deferred.verify();
+      }
+   }
+   while(deferred.reclaim(3) != 0) deferred.verify();
+   BOOST_TEST(!deferred.has_pending_reclaim());
+   for(std::size_t i = 0; i < 3; ++i) {
+      eager_sessions.pop_back();
+      deferred_sessions.pop_back();
+      BOOST_TEST((contents(eager) == contents(deferred)));
+      deferred.verify();
+   }
+   eager_sessions.clear();
+   deferred_sessions.clear();
+   deferred.commit_deferred(deferred.revision());
+   BOOST_TEST(deferred.has_pending_reclaim());
+   deferred.verify();
+   deferred.commit(deferred.revision());
+   BOOST_TEST(!deferred.has_pending_reclaim());
+   BOOST_TEST((contents(eager) == contents(deferred)));
+}
+
+BOOST_AUTO_TEST_CASE(test_squash_deferred) {
+   using index_type = chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::secondary>>>;
+   index_type eager, deferred;
+   auto contents = [](const index_type& idx) {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : idx) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   std::mt19937 rng(5);
+   int next_secondary = 0;
+   auto random_ops = [&] {
+      for(int i = 0; i < 10; ++i) {
+         auto op = rng() % 3;
+         if(op == 0 || eager.empty()) {
+            int secondary = next_secondary++;
+            eager.emplace([&](test_element_t& elem) { elem.secondary = secondary; });
+            deferred.emplace([&](test_element_t& elem) { elem.secondary = secondary; });
+         } else {
+            uint64_t id = eager.begin()->id + rng() % (eager.size() + 3);
+            const test_element_t* e = eager.find(id);
+            if(!e) continue;
+            const test_element_t* d = deferred.find(id);
+            if(op == 1) {
+               int secondary = next_secondary++;
+               eager.modify(*e, [&](test_element_t& elem) { elem.secondary = secondary; });
+               deferred.modify(*d, [&](test_element_t& elem) { elem.secondary = secondary; });
+            } else {
+               eager.remove(*e);
+               deferred.remove(*d);
+            }
+         }
+      }
+   };
+   for(int i = 0; i < 40; ++i) {
+      eager.emplace([&](test_element_t& elem) { elem.secondary = next_secondary; });
+      deferred.emplace([&](test_element_t& elem) { elem.secondary = next_secondary++; });
+   }
+   for(int round = 0; round < 200; ++round) {
+      switch(rng() % 5) {
+       case 0:
+       case 1:
+         eager.start_undo_session(true).push();
+         deferred.start_undo_session(true).push();
+         random_ops();
+         break;
+       case 2:
+         eager.squash();
+         deferred.squash_deferred();
+         break;
+       case 3:
+         eager.undo();
+         deferred.undo();
+         break;
+       case 4:
+         deferred.compress_pending(rng() % 8);
+         break;
+      }
+      BOOST_TEST((contents(eager) == contents(deferred)));
+      BOOST_TEST(eager.revision() == deferred.revision());
+      deferred.verify();
+   }
+   while(deferred.compress_pending(5) != 0) deferred.verify();
+   BOOST_TEST(!deferred.has_pending_compression());
+   eager.undo_all();
+   deferred.undo_all();
+   BOOST_TEST((contents(eager) == contents(deferred)));
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_to) {
+   using index_type = chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::secondary>>>;
+   index_type stepwise, combined;
+   auto contents = [](const index_type& idx) {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : idx) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   std::mt19937 rng(3);
+   for(int i = 0; i < 30; ++i) {
+      stepwise.emplace([&](test_element_t& elem) { elem.secondary = i; });
+      combined.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   int next_secondary = 30;
+   for(int round = 0; round < 40; ++round) {
+      stepwise.start_undo_session(true).push();
+      combined.start_undo_session(true).push();
+      for(int i = 0; i < 8; ++i) {
+         auto op = rng() % 3;
+         uint64_t id = rng() % static_cast<uint64_t>(next_secondary);
+         const test_element_t* s = stepwise.find(id);
+         if(op == 0 || !s) {
+            int secondary = next_secondary++;
+            stepwise.emplace([&](test_element_t& elem) { elem.secondary = secondary; });
+            combined.emplace([&](test_element_t& elem) { elem.secondary = secondary; });
+         } else if(op == 1) {
+            // Reuse freed secondary keys, so that undo has to restore values that collide transiently
+            int secondary = static_cast<int>(rng() % next_secondary);
+            if(stepwise.get<1>().find(secondary) != stepwise.get<1>().end()) secondary = next_secondary++;
+            stepwise.modify(*s, [&](test_element_t& elem) { elem.secondary = secondary; });
+            combined.modify(*combined.find(id), [&](test_element_t& elem) { elem.secondary = secondary; });
+         } else {
+            stepwise.remove(*s);
+            combined.remove(*combined.find(id));
+         }
+      }
+   }
+   for(int64_t target : { 35, 20, 19, 0 }) {
+      while(stepwise.revision() > target) stepwise.undo();
+      combined.undo_to(target);
+      BOOST_TEST(combined.revision() == target);
+      BOOST_TEST((contents(stepwise) == contents(combined)));
+      combined.verify();
+   }
+   combined.undo_to(-5);
+   BOOST_TEST(combined.revision() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_created_objects) {
+   using secondary_key = key<&test_element_t::secondary>;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ranked_unique<secondary_key>,
+                         chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>> i0;
+   auto contents = [&] {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : i0) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   for(int i = 0; i < 100; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i * 10; });
+   }
+   // One session that mostly creates objects, and one that does not
+   for(int created : { 1000, 50 }) {
+      auto expected = contents();
+      auto session = i0.start_undo_session(true);
+      uint64_t first_created = 0;
+      for(int i = 0; i < created; ++i) {
+         const auto& obj = i0.emplace([&](test_element_t& elem) { elem.secondary = i * 10 + 5; });
+         if(i == 0) first_created = obj.id;
+      }
+      i0.modify(*i0.find(3), [](test_element_t& elem) { elem.secondary = 7; });
+      i0.modify(*i0.find(first_created + 20), [](test_element_t& elem) { elem.secondary = 100001; });
+      i0.remove(*i0.find(5));
+      i0.remove(*i0.find(120));
+      i0.verify();
+      session.undo();
+      i0.verify();
+      BOOST_TEST((contents() == expected));
+      BOOST_TEST(i0.get<1>().nth(50)->secondary == 500);
+      BOOST_TEST(i0.get<by_secondary>().aggregate() == 49500);
+      const auto& added = i0.emplace([](test_element_t& elem) { elem.secondary = -1; });
+      BOOST_TEST(added.id == first_created);
+      i0.remove(added);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(test_undo_split) {
+   // Undo splits the new objects off the id index.  Split at many positions in trees of
+   // many shapes, and check that the trees stay balanced and keep their sizes.
+   using secondary_key = key<&test_element_t::secondary>;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ranked_unique<key<&test_element_t::id>>,
+                         chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>> i0;
+   std::mt19937 rng(7);
+   int next_secondary = 0;
+   for(int round = 0; round < 60; ++round) {
+      int kept = static_cast<int>(rng() % 700);
+      for(int i = 0; i < kept; ++i) {
+         i0.emplace([&](test_element_t& elem) { elem.secondary = next_secondary++; });
+      }
+      // Removing objects in the middle gives the id index an irregular shape
+      for(int i = 0; i < kept / 4; ++i) {
+         if(const test_element_t* obj = i0.find(i0.get<0>().nth(rng() % i0.size())->id)) i0.remove(*obj);
+      }
+      std::size_t size_before = i0.size();
+      auto sum_before = i0.get<by_secondary>().aggregate();
+      auto session = i0.start_undo_session(true);
+      int created = static_cast<int>(rng() % 700);
+      for(int i = 0; i < created; ++i) {
+         i0.emplace([&](test_element_t& elem) { elem.secondary = next_secondary++; });
+      }
+      session.undo();
+      i0.verify();
+      BOOST_TEST(i0.size() == size_before);
+      BOOST_TEST(i0.get<0>().nth(i0.size()) == i0.get<0>().end());
+      BOOST_TEST(i0.get<by_secondary>().aggregate() == sum_before);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(test_erase_range) {
+   using secondary_key = key<&test_element_t::secondary>;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ranked_unique<secondary_key>,
+                         chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>> i0;
+   auto contents = [&] {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : i0) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   for(int i = 0; i < 200; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = (i * 7) % 200; });
+   }
+   auto expected = contents();
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(*i0.find(30), [](test_element_t& elem) { elem.secondary = 1000; });
+      i0.emplace([](test_element_t& elem) { elem.secondary = 250; });
+      // Every key in [50, 120) is in use
+      BOOST_TEST(i0.erase_range<by_secondary>(50, 120) == 70u);
+      BOOST_TEST(i0.get<by_secondary>().lower_bound(50)->secondary == 120);
+      BOOST_TEST(i0.get<1>().nth(49)->secondary == 120);
+      // ids 10 to 17 were already removed by the first range
+      BOOST_TEST(i0.erase_range<0>(10, 20) == 2u);
+      BOOST_TEST(i0.erase_range<0>(20, 10) == 0u);
+      BOOST_TEST(i0.erase_range<0>(190, 1000) == 11u); // including the object created in the session
+      BOOST_TEST(i0.find(18) == nullptr);
+      BOOST_TEST(i0.find(200) == nullptr);
+      BOOST_TEST(i0.size() == 118u);
+      i0.verify();
+   }
+   i0.verify();
+   BOOST_TEST((contents() == expected));
+   // Without an undo session the objects are freed
+   BOOST_TEST(i0.erase_range<by_secondary>(0, 100) == 100u);
+   BOOST_TEST(i0.get<by_secondary>().aggregate() == 14950);
+   i0.verify();
+   // Only ids 15 to 19 are left below 20.  The size of index 0 must not depend on counting the rest.
+   BOOST_TEST(i0.erase_range<0>(0, 20) == 5u);
+   BOOST_TEST(i0.size() == 95u);
+   i0.verify();
+}
+
+EXCEPTION_TEST_CASE(test_insert_sorted_run) {
+   using secondary_key = key<&test_element_t::secondary>;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ranked_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<secondary_key>,
+                         chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>> i0;
+   auto contents = [&] {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : i0) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   for(int i = 0; i < 100; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i < 50 ? i : i + 100; });
+   }
+   auto expected = contents();
+   {
+      auto undo_checker = capture_state(i0);
+      auto session = i0.start_undo_session(true);
+      // [50, 150) is free
+      i0.insert_sorted_run<by_secondary>(100, [](test_element_t& elem, std::size_t i) { elem.secondary = 50 + static_cast<int>(i); });
+      BOOST_TEST(i0.size() == 200u);
+      BOOST_TEST(i0.get<0>().nth(150)->id == 150u);
+      BOOST_TEST(i0.get<by_secondary>().aggregate() == 19900);
+      BOOST_TEST(i0.find(100)->secondary == 50);
+      i0.verify();
+      // out of order, overlapping, and empty runs
+      BOOST_CHECK_THROW(i0.insert_sorted_run<by_secondary>(2, [](test_element_t& elem, std::size_t i) { elem.secondary = 301 - static_cast<int>(i); }), std::logic_error);
+      BOOST_CHECK_THROW(i0.insert_sorted_run<by_secondary>(3, [](test_element_t& elem, std::size_t i) { elem.secondary = -2 + static_cast<int>(i); }), std::logic_error);
+      i0.insert_sorted_run<0>(0, [](test_element_t&, std::size_t) {});
+      BOOST_TEST(i0.size() == 200u);
+      i0.verify();
+      // by id, which appends the run
+      i0.insert_sorted_run<0>(10, [](test_element_t& elem, std::size_t i) { elem.secondary = 1000 - static_cast<int>(i); });
+      BOOST_TEST(i0.get<1>().rbegin()->id == 200u);
+      BOOST_TEST(i0.size() == 210u);
+      i0.verify();
+   }
+   i0.verify();
+   BOOST_TEST((contents() == expected));
+   // Without an undo session the objects are kept
+   i0.insert_sorted_run<1>(5, [](test_element_t& elem, std::size_t i) { elem.secondary = 200 + static_cast<int>(i); });
+   BOOST_TEST(i0.size() == 105u);
+   BOOST_TEST(i0.find(100)->secondary == 200);
+   i0.verify();
+}
+
+BOOST_AUTO_TEST_CASE(test_absolute_links) {
+   // With std::allocator the nodes link by address instead of by offset
+   using secondary_key = key<&test_element_t::secondary>;
+   using index_type = chainbase::undo_index<test_element_t, std::allocator<test_element_t>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                                            chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>>;
+   static_assert(chainbase::uses_absolute_links<std::allocator<test_element_t>>);
+   static_assert(!chainbase::uses_absolute_links<test_allocator<test_element_t>>);
+   index_type i0;
+   auto contents = [](const index_type& idx) {
+      std::vector<std::pair<uint64_t, int>> result;
+      for(const auto& elem : idx) result.emplace_back(elem.id, elem.secondary);
+      return result;
+   };
+   for(int i = 0; i < 100; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   auto expected = contents(i0);
+   {
+      auto session = i0.start_undo_session(true);
+      for(int i = 0; i < 100; i += 3) {
+         i0.modify(*i0.find(i), [](test_element_t& elem) { elem.secondary += 1000; });
+      }
+      for(int i = 1; i < 100; i += 5) {
+         i0.remove(*i0.find(i));
+      }
+      for(int i = 0; i < 300; ++i) {
+         i0.emplace([&](test_element_t& elem) { elem.secondary = 2000 + i; });
+      }
+      i0.verify();
+   }
+   i0.verify();
+   BOOST_TEST((contents(i0) == expected));
+   // Moving the index moves the tree headers, which the roots link to by address
+   index_type i1{std::move(i0)};
+   i1.verify();
+   BOOST_TEST((contents(i1) == expected));
+   i1.emplace([](test_element_t& elem) { elem.secondary = -1; });
+   BOOST_TEST(i1.get<by_secondary>().aggregate() == 4950 - 1);
+   i1.verify();
+}
+
+BOOST_AUTO_TEST_CASE(test_verify) {
+   using secondary_key = key<&test_element_t::secondary>;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ranked_unique<secondary_key>,
+                         chainbase::aggregated_unique<chainbase::sum_of<secondary_key>, boost::multi_index::tag<by_secondary>, secondary_key>> i0;
+   for(int i = 0; i < 50; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i * 2; });
+   }
+   i0.verify();
+   auto session = i0.start_undo_session(true);
+   for(int i = 0; i < 50; i += 3) {
+      i0.modify(*i0.find(i), [](test_element_t& elem) { elem.secondary += 1000; });
+   }
+   for(int i = 0; i < 50; i += 7) {
+      i0.remove(*i0.find(i));
+   }
+   i0.emplace([](test_element_t& elem) { elem.secondary = 5; });
+   session.push();
+   auto session2 = i0.start_undo_session(true);
+   i0.modify(*i0.find(1), [](test_element_t& elem) { elem.secondary = -1; });
+   i0.remove(*i0.find(2));
+   i0.verify();
+
+   // Changing a key behind the back of the index breaks the order of the secondary indices
+   auto& elem = const_cast<test_element_t&>(*i0.find(4));
+   int saved = elem.secondary;
+   elem.secondary = 100000;
+   BOOST_CHECK_THROW(i0.verify(), std::runtime_error);
+   elem.secondary = saved;
+   i0.verify();
+   session2.undo();
+   i0.verify();
+   BOOST_TEST(i0.size() == 43u);
+}
 
 EXCEPTION_TEST_CASE(test_remove_tracking_session) {
    chainbase::undo_index<test_element_t, test_allocator<test_element_t>,